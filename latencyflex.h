@@ -49,9 +49,19 @@ public:
   // Update the estimate with `value`. `value` must not be negative. If a
   // negative exponent is used, then `value` must not be too small or the
   // internal accumulator will overflow.
-  void update(double value) {
-    current_ = (1 - alpha_) * current_ + alpha_ * value;
-    current_weight_ = (1 - alpha_) * current_weight_ + alpha_;
+  //
+  // `weight` in [0, 1] scales the influence of the sample. A weight of 0
+  // leaves the estimate unchanged.
+  void update(double value, double weight = 1.0) {
+    double alpha = alpha_ * weight;
+    current_ = (1 - alpha) * current_ + alpha * value;
+    current_weight_ = (1 - alpha) * current_weight_ + alpha;
+  }
+
+  // Replace the estimate with `value`, weighted at 100%.
+  void reset(double value) {
+    current_ = value;
+    current_weight_ = 1.0;
   }
 
   double get() const {
@@ -66,10 +76,131 @@ private:
   double current_ = 0;
   double current_weight_;
 };
+
+// Detects frame costs that repeat with a period of a few frames, such as a simulation ticking every
+// other frame, and learns the completion interval and latency of each frame of the period relative
+// to the average frame.
+//
+// For each candidate period, the deviation from the mean is averaged per position in the period.
+// The period is detected once these averages explain most of the variance of the completion
+// intervals. Multiples of the period explain it as well, so the shortest one is chosen.
+class PeriodicityDetector {
+public:
+  static const size_t kMaxPeriod = 8;
+
+  // Add the completion interval and latency of `frame_id`. `interval` is negative if unknown, e.g.
+  // when the previous frame was not tracked.
+  void Update(uint64_t frame_id, double interval, double latency) {
+    if (interval < 0)
+      return;
+    interval_mean_.update(interval);
+    latency_mean_.update(latency);
+    double interval_dev = interval - interval_mean_.get();
+    double latency_dev = latency - latency_mean_.get();
+    variance_.update(interval_dev * interval_dev);
+    samples_++;
+
+    size_t best_period = 0;
+    double best_score = 0;
+    double scores[kMaxPeriod + 1] = {};
+    for (size_t period = 2; period <= kMaxPeriod; period++) {
+      size_t slot = SlotBase(period) + frame_id % period;
+      interval_slots_[slot] += kSlotAlpha * (interval_dev - interval_slots_[slot]);
+      latency_slots_[slot] += kSlotAlpha * (latency_dev - latency_slots_[slot]);
+      double explained = 0;
+      for (size_t i = 0; i < period; i++)
+        explained += interval_slots_[SlotBase(period) + i] * interval_slots_[SlotBase(period) + i];
+      explained /= period;
+      // Ignore patterns too small to matter for pacing, such as the residue of our own probing.
+      double min_amplitude = kMinAmplitude * interval_mean_.get();
+      if (samples_ < kMinSamples || explained < min_amplitude * min_amplitude)
+        continue;
+      scores[period] = explained / variance_.get();
+      if (scores[period] > best_score) {
+        best_score = scores[period];
+        best_period = period;
+      }
+    }
+
+    if (period_ != 0 && scores[period_] >= kKeepScore && scores[period_] >= 0.9 * best_score)
+      return;
+    period_ = 0;
+    if (best_score < kDetectScore)
+      return;
+    for (size_t period = 2; period <= best_period; period++) {
+      if (scores[period] >= 0.9 * best_score) {
+        period_ = period;
+        break;
+      }
+    }
+  }
+
+  // Get the detected period in frames, or 0 if the workload is not periodic.
+  size_t period() const { return period_; }
+
+  // Get the expected total completion interval of the frames in (`from`, `to`], relative to the
+  // average frame. Returns 0 if the workload is not periodic.
+  double IntervalOffset(uint64_t from, uint64_t to) const {
+    if (period_ == 0 || to <= from)
+      return 0;
+    // The offsets of a whole period sum up to about zero.
+    size_t frames = (to - from) % period_;
+    double offset = 0;
+    for (size_t i = 0; i < frames; i++) {
+      // Completion intervals are only uneven because frame costs are, so they cannot differ from
+      // the average by more than latencies do. Learning more would preserve idle gaps our own
+      // pacing has introduced before heavy frames, instead of closing them.
+      double latency_offset = std::abs(Offset(latency_slots_, to - i));
+      offset += std::clamp(Offset(interval_slots_, to - i), -latency_offset, latency_offset);
+    }
+    return offset;
+  }
+
+  // Get the expected latency of `frame_id` relative to the average frame, or 0 if the workload is
+  // not periodic.
+  double LatencyOffset(uint64_t frame_id) const {
+    return period_ != 0 ? Offset(latency_slots_, frame_id) : 0;
+  }
+
+private:
+  static constexpr double kSlotAlpha = 0.1;
+  static constexpr double kMinAmplitude = 0.05;
+  static constexpr double kDetectScore = 0.6;
+  static constexpr double kKeepScore = 0.4;
+  static const uint64_t kMinSamples = 8 * kMaxPeriod;
+  // The slots of each candidate period are stored back to back, starting with period 2.
+  static const size_t kNumSlots = kMaxPeriod * (kMaxPeriod + 1) / 2 - 1;
+  static constexpr size_t SlotBase(size_t period) { return period * (period - 1) / 2 - 1; }
+
+  double Offset(const double *slots, uint64_t frame_id) const {
+    double mean = 0;
+    for (size_t i = 0; i < period_; i++)
+      mean += slots[SlotBase(period_) + i];
+    return slots[SlotBase(period_) + frame_id % period_] - mean / period_;
+  }
+
+  EwmaEstimator interval_mean_ = EwmaEstimator(0.1);
+  EwmaEstimator latency_mean_ = EwmaEstimator(0.1);
+  EwmaEstimator variance_ = EwmaEstimator(0.1);
+  double interval_slots_[kNumSlots] = {};
+  double latency_slots_[kNumSlots] = {};
+  uint64_t samples_ = 0;
+  size_t period_ = 0;
+};
 } // namespace internal
 
 enum Phases { kUp = 0, kDown, kNumPhases };
 
+// Intermediate points in the frame pipeline that can be optionally reported with `MarkStage()`.
+enum Stages {
+  kInputSample = 0,
+  kSimulationEnd,
+  kRenderSubmit,
+  kRenderBegin,
+  kRenderEnd,
+  kNumStages
+};
+
 // Tracks and computes frame time, latency and the desired sleep time before
 // next tick. All time is in nanoseconds. The clock domain doesn't matter as
 // long as it's a single consistent clock.
@@ -88,8 +219,10 @@ public:
   // If a wait target cannot be determined due to lack of data, then `0` is
   // returned.
   uint64_t GetWaitTarget(uint64_t frame_id) {
+    sync_stall_applied_ = 0;
+    size_t phase = Phase(frame_id);
+    frame_phases_[frame_id % kMaxInflightFrames] = phase;
     if (prev_frame_end_id_ != UINT64_MAX) {
-      size_t phase = frame_id % kNumPhases;
       double invtpt = inv_throughtput_.get();
       int64_t comp_to_apply = 0;
       if (frame_end_projection_base_ == UINT64_MAX) {
@@ -139,15 +272,24 @@ public:
         TRACE_COUNTER("latencyflex", "Delay Compensation", comp_to_apply);
       }
 
+      // In a periodic workload, frames are projected to complete after their own expected interval
+      // instead of the average one, and heavy frames begin earlier by their extra latency.
+      double periodic_offset =
+          periodicity_.IntervalOffset(prev_frame_begin_id_, frame_id) / down_factor_;
       // The target wakeup time.
       uint64_t target =
           (int64_t)frame_end_projection_base_ +
           (int64_t)frame_end_projected_ts_[prev_frame_begin_id_ % kMaxInflightFrames] +
           comp_to_apply +
           (int64_t)std::round((((int64_t)frame_id - (int64_t)prev_frame_begin_id_) +
-                               1 / (phase == kUp ? up_factor_ : 1) - 1) *
-                                  invtpt / down_factor_ -
-                              latency_.get());
+                               1 / (phase == kUp ? UpFactor() : 1) - 1) *
+                                  invtpt / down_factor_ +
+                              periodic_offset - latency_.get() -
+                              periodicity_.LatencyOffset(frame_id));
+      // Not part of the projection: waking up early by the blocked time is counted as a
+      // correction in `BeginFrame()`, so the schedule of later frames moves earlier as well.
+      sync_stall_applied_ = std::round(sync_stall_.get());
+      target -= sync_stall_applied_;
       // The projection is something close to the predicted frame end time, but it is always paced
       // at down_factor * throughput, which prevents delay compensation from kicking in until it's
       // actually necessary (i.e. we're overpacing).
@@ -155,7 +297,8 @@ public:
           (int64_t)frame_end_projected_ts_[prev_frame_begin_id_ % kMaxInflightFrames] +
           comp_to_apply +
           (int64_t)std::round(((int64_t)frame_id - (int64_t)prev_frame_begin_id_) * invtpt /
-                              down_factor_);
+                                  down_factor_ +
+                              periodic_offset);
       frame_end_projected_ts_[frame_id % kMaxInflightFrames] = new_projection;
       TRACE_EVENT_BEGIN(
           "latencyflex", "projection",
@@ -189,13 +332,66 @@ public:
     frame_begin_ts_[frame_id % kMaxInflightFrames] = timestamp;
     prev_frame_begin_id_ = frame_id;
     if (target != 0) {
-      int64_t forced_correction = timestamp - target;
+      int64_t forced_correction = timestamp - (target + sync_stall_applied_);
       frame_end_projected_ts_[frame_id % kMaxInflightFrames] += forced_correction;
       comp_applied_[frame_id % kMaxInflightFrames] += forced_correction;
       prev_prediction_error_ += forced_correction;
     }
   }
 
+  // Record that the frame has reached `stage`. Can be called from any thread, between the
+  // `BeginFrame()` and `EndFrame()` of the frame.
+  //
+  // Stages are informational: they provide a breakdown of the latency, but do not affect pacing.
+  void MarkStage(uint64_t frame_id, Stages stage, uint64_t timestamp) {
+    if (frame_begin_ids_[frame_id % kMaxInflightFrames] != frame_id)
+      return;
+    stage_ts_[frame_id % kMaxInflightFrames][stage] = timestamp;
+  }
+
+  // Report the time the application spent blocked on the GPU (e.g. in vkQueueWaitIdle) on the
+  // thread that begins frames, since the previous call. `end_ts` is the time the last wait
+  // returned. Call once per frame before `GetWaitTarget()`.
+  //
+  // A wait that outlasts the GPU work of the frame begun last drains the queue: the application
+  // serializes itself, and sleeping as well only costs throughput. The wake-up target is moved
+  // earlier by the estimated blocked time of such waits. Waits on earlier frames are backpressure,
+  // which pacing removes by itself, so they are not taken into account.
+  void ReportSyncStall(uint64_t duration, uint64_t end_ts) {
+    bool drained = duration != 0 && prev_frame_end_id_ == prev_frame_begin_id_ &&
+                   prev_frame_real_end_ts_ <= end_ts + kSyncStallTolerance;
+    sync_stall_.update(drained ? duration : 0);
+    last_sync_stall_time_ = duration;
+    TRACE_COUNTER("latencyflex", "Sync Stall", duration);
+  }
+
+  // Record that `duration` was spent compiling pipelines on a thread on the critical path of the
+  // frame. Can be called multiple times per frame, between the `BeginFrame()` and `EndFrame()` of
+  // the frame.
+  //
+  // Compile stalls are one-off: the frame is down-weighted in the latency and throughput estimates
+  // in proportion to the stall, and excluded entirely once the stall reaches
+  // `kCompileExclusionRatio` of the estimated frame time.
+  void AddCompileTime(uint64_t frame_id, uint64_t duration) {
+    if (frame_begin_ids_[frame_id % kMaxInflightFrames] != frame_id)
+      return;
+    compile_time_[frame_id % kMaxInflightFrames] += duration;
+  }
+
+  // Report the GPU time of a frame, measured from timestamps written before and after its work on
+  // the GPU: `busy` is the time the GPU spent on the frame, and `idle` the gap between the end of
+  // the previous frame and the start of this one. Call before the `EndFrame()` of the frame.
+  //
+  // The spacing of frame completions includes idle gaps, e.g. those introduced by our own pacing.
+  // When the GPU is the bottleneck (utilization of at least `kGpuBoundUtilization`), the busy time
+  // is used as the throughput signal instead.
+  void ReportGpuTime(uint64_t frame_id, uint64_t busy, uint64_t idle) {
+    if (frame_begin_ids_[frame_id % kMaxInflightFrames] != frame_id || busy == 0)
+      return;
+    gpu_busy_[frame_id % kMaxInflightFrames] = busy;
+    gpu_idle_[frame_id % kMaxInflightFrames] = idle;
+  }
+
   // End the frame. Called from a rendering-related thread.
   //
   // The timestamp should be obtained in one of the following ways:
@@ -208,7 +404,8 @@ public:
   // time are returned respectively, or UINT64_MAX is returned if measurement is
   // unavailable.
   void EndFrame(uint64_t frame_id, uint64_t timestamp, uint64_t *latency, uint64_t *frame_time) {
-    size_t phase = frame_id % kNumPhases;
+    // The phase may have changed since the wait target of the frame was computed.
+    size_t phase = frame_phases_[frame_id % kMaxInflightFrames];
     int64_t latency_val = -1;
     int64_t frame_time_val = -1;
     if (frame_begin_ids_[frame_id % kMaxInflightFrames] == frame_id) {
@@ -220,41 +417,237 @@ public:
       timestamp = std::max(timestamp, prev_frame_end_ts_ + target_frame_time);
       auto frame_start = frame_begin_ts_[frame_id % kMaxInflightFrames];
       latency_val = (int64_t)timestamp - (int64_t)frame_start;
+      uint64_t gpu_busy = gpu_busy_[frame_id % kMaxInflightFrames];
+      uint64_t gpu_idle = gpu_idle_[frame_id % kMaxInflightFrames];
+      gpu_busy_[frame_id % kMaxInflightFrames] = 0;
+      if (gpu_busy != 0)
+        gpu_time_.update(gpu_busy);
+      last_gpu_utilization_ = gpu_busy != 0 ? (double)gpu_busy / (gpu_busy + gpu_idle) : -1;
+      last_compile_time_ = compile_time_[frame_id % kMaxInflightFrames];
+      compile_time_[frame_id % kMaxInflightFrames] = 0;
+      double weight = 1.0;
+      if (last_compile_time_ != 0) {
+        // Without a frame time estimate yet, any compile stall excludes the frame.
+        double limit = kCompileExclusionRatio * inv_throughtput_.get();
+        weight = limit > 0 ? std::clamp(1.0 - last_compile_time_ / limit, 0.0, 1.0) : 0.0;
+        TRACE_COUNTER("latencyflex", "Compile Stall", last_compile_time_);
+      }
       if (phase == kDown) {
-        latency_.update(latency_val);
+        // Estimates are kept for the average frame of a periodic workload.
+        latency_.update(latency_val - periodicity_.LatencyOffset(frame_id), weight);
       }
-      if (latency)
-        *latency = latency_val;
       TRACE_COUNTER("latencyflex", "Latency", latency_val);
       TRACE_COUNTER("latencyflex", "Latency (Estimate)", latency_.get());
+      uint64_t *stage_ts = stage_ts_[frame_id % kMaxInflightFrames];
+      if (stage_ts[kRenderBegin] != 0 && stage_ts[kRenderEnd] > stage_ts[kRenderBegin]) {
+        // Time spent by the rendering thread on this frame. When it approaches the frame time,
+        // the rendering thread is the bottleneck.
+        render_thread_time_.update(stage_ts[kRenderEnd] - stage_ts[kRenderBegin]);
+        TRACE_COUNTER("latencyflex", "Render Thread Time",
+                      stage_ts[kRenderEnd] - stage_ts[kRenderBegin]);
+      }
+      for (size_t stage = 0; stage < kNumStages; stage++) {
+        if (stage_ts[stage] != 0 && stage_ts[stage] >= frame_start) {
+          stage_latency_[stage].update(stage_ts[stage] - frame_start);
+          TRACE_COUNTER("latencyflex", kStageNames[stage], stage_ts[stage] - frame_start);
+        }
+        stage_ts[stage] = 0;
+      }
+      double interval = -1;
       if (prev_frame_end_id_ != UINT64_MAX) {
         if (frame_id > prev_frame_end_id_) {
           auto frames_elapsed = frame_id - prev_frame_end_id_;
           frame_time_val =
               ((int64_t)timestamp - (int64_t)prev_frame_end_ts_) / (int64_t)frames_elapsed;
           frame_time_val = std::clamp(frame_time_val, INT64_C(1000000), INT64_C(50000000));
+          if (frames_elapsed == 1)
+            interval = frame_time_val;
+          int64_t throughput_val = frame_time_val;
+          if (last_gpu_utilization_ >= kGpuBoundUtilization)
+            throughput_val = std::clamp((int64_t)std::max(gpu_busy, target_frame_time),
+                                        INT64_C(1000000), INT64_C(50000000));
           if (phase == kUp) {
-            inv_throughtput_.update(frame_time_val);
+            double sample = throughput_val - periodicity_.IntervalOffset(prev_frame_end_id_,
+                                                                         frame_id) /
+                                                 frames_elapsed;
+            // The recovery from a load drop ends once probing stops finding more throughput.
+            if (sample < inv_throughtput_.get())
+              failed_probes_ = 0;
+            else if (++failed_probes_ >= kLoadDropFailedProbes)
+              load_drop_ = false;
+            inv_throughtput_.update(sample, weight);
+          }
+          // Delay compensation only reacts to delay increases, and the up phase finds throughput
+          // increases by at most `up_factor` at a time, so recovering from a load drop would take
+          // many frames. But a frame that completes before the next one has even begun leaves the
+          // whole pipeline idle: beginning frames one latency apart cannot queue, so the estimate
+          // is lowered to the latency right away, and the up phase probes further from there in
+          // larger steps.
+          //
+          // The pipeline also idles between frames when it is throttled outside of the tick, such
+          // as by vsync or an external limiter, where beginning frames earlier only makes them
+          // wait. So the load drop is only counted once the completion spacing of the frames begun
+          // since has shrunk as well. Otherwise, the estimate is restored, and detection is held
+          // off for increasingly long.
+          double serial_frame_time = std::max(
+              latency_val - periodicity_.LatencyOffset(frame_id), (double)target_frame_time);
+          if (load_drop_pending_) {
+            if (frame_id >= load_drop_check_begin_ && load_drop_check_end_id_ == UINT64_MAX) {
+              load_drop_check_end_id_ = prev_frame_end_id_;
+              load_drop_check_end_ts_ = prev_frame_end_ts_;
+            }
+            if (load_drop_check_end_id_ != UINT64_MAX &&
+                frame_id - load_drop_check_end_id_ >= kLoadDropCheckFrames) {
+              double spacing = (double)(timestamp - load_drop_check_end_ts_) /
+                               (frame_id - load_drop_check_end_id_);
+              load_drop_pending_ = false;
+              if (spacing < (1 - kLoadDropRatio / 2) * load_drop_prev_estimate_ &&
+                  spacing < (load_drop_prev_estimate_ + load_drop_estimate_) / 2) {
+                load_drop_holdoff_ = frame_id + kLoadDropHoldoff;
+                load_drop_holdoff_frames_ = kLoadDropHoldoff;
+              } else {
+                inv_throughtput_.reset(load_drop_prev_estimate_);
+                load_drop_ = false;
+                load_drop_holdoff_ = frame_id + load_drop_holdoff_frames_;
+                load_drop_holdoff_frames_ =
+                    std::min(2 * load_drop_holdoff_frames_, kMaxLoadDropHoldoff);
+                TRACE_COUNTER("latencyflex", "Load Drop", 0);
+              }
+            }
+          } else if (weight == 1.0 && frame_id >= load_drop_holdoff_ &&
+                     serial_frame_time < (1 - kLoadDropRatio) * inv_throughtput_.get()) {
+            load_drop_prev_estimate_ = inv_throughtput_.get();
+            load_drop_estimate_ = serial_frame_time;
+            inv_throughtput_.reset(serial_frame_time);
+            load_drop_ = true;
+            failed_probes_ = 0;
+            load_drop_pending_ = true;
+            // Frames begun already were paced at the previous estimate.
+            load_drop_check_begin_ = prev_frame_begin_id_ + 1;
+            load_drop_check_end_id_ = UINT64_MAX;
+            TRACE_COUNTER("latencyflex", "Load Drop", serial_frame_time);
           }
           TRACE_COUNTER("latencyflex", "Frame Time", frame_time_val);
+          if (gpu_busy != 0) {
+            TRACE_COUNTER("latencyflex", "GPU Busy", gpu_busy);
+          }
           TRACE_COUNTER("latencyflex", "Frame Time (Estimate)", inv_throughtput_.get());
         }
       }
+      // Compile stalls are one-off and would read as noise.
+      if (last_compile_time_ == 0) {
+        periodicity_.Update(frame_id, interval, latency_val);
+        TRACE_COUNTER("latencyflex", "Period", periodicity_.period());
+      }
+      // A frame completing later than projected means the probing has started to build a queue.
+      if (frame_end_projection_base_ != UINT64_MAX &&
+          timestamp > frame_end_projection_base_ +
+                          frame_end_projected_ts_[frame_id % kMaxInflightFrames])
+        load_drop_ = false;
       prev_frame_end_id_ = frame_id;
       prev_frame_end_ts_ = timestamp;
     }
+    if (latency)
+      *latency = latency_val;
     if (frame_time)
       *frame_time = frame_time_val;
     TRACE_EVENT_END("latencyflex", perfetto::Track(track_base_ + frame_id % kMaxInflightFrames),
                     timestamp);
   }
 
+  // Get the latest time the render submit of `frame_id` can happen without delaying the frame's
+  // completion, for engines that sample input or the camera again right before submitting. Work
+  // submitted earlier only waits in the queue. Call after `BeginFrame()`.
+  //
+  // The deadline is the projected frame end, less the GPU time if reported, or otherwise the time
+  // from the render submit stage to frame end. The latter includes any time the work waited in the
+  // queue, which makes the deadline early. Returns 0 if neither is known, or if the frame has not
+  // begun. The time the submission itself takes is not accounted for.
+  uint64_t GetSubmitDeadline(uint64_t frame_id) const {
+    if (frame_begin_ids_[frame_id % kMaxInflightFrames] != frame_id ||
+        frame_end_projection_base_ == UINT64_MAX)
+      return 0;
+    double render_time = gpu_time_.get();
+    if (render_time == 0 && stage_latency_[kRenderSubmit].get() > 0)
+      render_time = latency_.get() - stage_latency_[kRenderSubmit].get();
+    uint64_t projected_end =
+        frame_end_projection_base_ + frame_end_projected_ts_[frame_id % kMaxInflightFrames];
+    if (render_time <= 0 || render_time >= projected_end)
+      return 0;
+    return projected_end - (uint64_t)std::round(render_time);
+  }
+
+  // Get the estimated time from frame begin to `stage`, or 0 if the stage has not been reported.
+  double GetStageLatency(Stages stage) const { return stage_latency_[stage].get(); }
+
+  // Get the estimated time between frames at the current throughput, or 0 if not known yet.
+  double GetFrameTime() const { return inv_throughtput_.get(); }
+
+  // Get the estimated GPU time of a frame, or 0 if GPU time is not reported.
+  double GetGpuTime() const { return gpu_time_.get(); }
+
+  // Get the estimated time spent by the rendering thread per frame, or 0 if the render begin and
+  // end stages have not been reported.
+  double GetRenderThreadTime() const { return render_thread_time_.get(); }
+
+  // Get the compile time recorded for the frame last passed to `EndFrame()`.
+  uint64_t GetLastCompileTime() const { return last_compile_time_; }
+
+  // Get the GPU utilization of the frame last passed to `EndFrame()`, in [0, 1], or a negative
+  // value if its GPU time was not reported.
+  double GetLastGpuUtilization() const { return last_gpu_utilization_; }
+
+  // Get the blocked time last passed to `ReportSyncStall()`.
+  uint64_t GetLastSyncStall() const { return last_sync_stall_time_; }
+
+  // Get the period in frames of a recurring frame cost pattern, or 0 if none is detected.
+  size_t GetPeriod() const { return periodicity_.period(); }
+
+  // Get whether pacing is recovering from a drop in frame cost.
+  bool IsRecoveringFromLoadDrop() const { return load_drop_; }
+
+  static constexpr double kCompileExclusionRatio = 0.25;
+  // Slack between the end of a wait and the completion timestamp of the frame, which are captured
+  // on different threads.
+  static constexpr uint64_t kSyncStallTolerance = 500000;
+  static constexpr double kGpuBoundUtilization = 0.9;
+  // The up and down phases alternate every frame. Once a period is detected, the alternation skips
+  // a frame every `kPhaseRotation` frames. Otherwise, a workload with an even period would always
+  // have the same frames of the period in the up phase, biasing the estimates toward their cost.
+  // Must be odd and larger than the longest detected period.
+  static const uint64_t kPhaseRotation = 11;
+  // A frame whose latency is below the estimated frame time by at least this ratio signals a load
+  // drop. It is confirmed if this many frames begun afterwards complete closer together by at least
+  // half that ratio on average. Detection is then held off for `kLoadDropHoldoff` frames, doubling
+  // after each detection that is not confirmed, up to `kMaxLoadDropHoldoff`.
+  static constexpr double kLoadDropRatio = 0.1;
+  static const uint64_t kLoadDropCheckFrames = 8;
+  static constexpr uint64_t kLoadDropHoldoff = 64;
+  static constexpr uint64_t kMaxLoadDropHoldoff = 4096;
+  // While recovering from a load drop, the up phase scales the wait target by at least this factor,
+  // until this many probes in a row fail to find more throughput.
+  static constexpr double kLoadDropUpFactor = 1.3;
+  static const int kLoadDropFailedProbes = 2;
+
+  static constexpr double kDefaultUpFactor = 1.10;
+  static constexpr double kDefaultDownFactor = 0.985;
+
+  // Set the factors by which the wait target is scaled in the up and down phases. `up_factor`
+  // controls how fast throughput increases are detected, and `down_factor` how much below the
+  // estimated throughput frames are paced to drain queues.
+  void SetFactors(double up_factor, double down_factor) {
+    up_factor_ = up_factor;
+    down_factor_ = down_factor;
+  }
+
   void Reset() {
     auto new_instance = LatencyFleX();
 #ifdef LATENCYFLEX_HAVE_PERFETTO
     new_instance.track_base_ = track_base_ + 2 * kMaxInflightFrames;
 #endif
     new_instance.target_frame_time = target_frame_time;
+    new_instance.up_factor_ = up_factor_;
+    new_instance.down_factor_ = down_factor_;
     *this = new_instance;
   }
 
@@ -262,15 +655,49 @@ public:
 
 private:
   static const std::size_t kMaxInflightFrames = 16;
+  static_assert(kPhaseRotation % 2 == 1 &&
+                kPhaseRotation > internal::PeriodicityDetector::kMaxPeriod);
+
+  size_t Phase(uint64_t frame_id) const {
+    if (periodicity_.period() == 0)
+      return frame_id % kNumPhases;
+    return (frame_id + frame_id / kPhaseRotation) % kNumPhases;
+  }
+
+  double UpFactor() const {
+    return load_drop_ ? std::max(up_factor_, kLoadDropUpFactor) : up_factor_;
+  }
+  static constexpr const char *kStageNames[kNumStages] = {
+      "Input Sample Latency", "Simulation End Latency", "Render Submit Latency",
+      "Render Begin Latency", "Render End Latency"};
 
   uint64_t frame_begin_ts_[kMaxInflightFrames] = {};
   uint64_t frame_begin_ids_[kMaxInflightFrames];
+  uint64_t stage_ts_[kMaxInflightFrames][kNumStages] = {};
+  uint64_t compile_time_[kMaxInflightFrames] = {};
+  size_t frame_phases_[kMaxInflightFrames] = {};
+  uint64_t last_compile_time_ = 0;
+  uint64_t last_sync_stall_time_ = 0;
+  uint64_t gpu_busy_[kMaxInflightFrames] = {};
+  uint64_t gpu_idle_[kMaxInflightFrames] = {};
+  double last_gpu_utilization_ = -1;
+  int64_t sync_stall_applied_ = 0;
+  bool load_drop_ = false;
+  int failed_probes_ = 0;
+  bool load_drop_pending_ = false;
+  double load_drop_prev_estimate_ = 0;
+  double load_drop_estimate_ = 0;
+  uint64_t load_drop_check_begin_ = 0;
+  uint64_t load_drop_check_end_id_ = UINT64_MAX;
+  uint64_t load_drop_check_end_ts_ = 0;
+  uint64_t load_drop_holdoff_ = 0;
+  uint64_t load_drop_holdoff_frames_ = kLoadDropHoldoff;
   uint64_t frame_end_projected_ts_[kMaxInflightFrames] = {};
   uint64_t frame_end_projection_base_ = UINT64_MAX;
   int64_t comp_applied_[kMaxInflightFrames] = {};
   uint64_t prev_frame_begin_id_ = UINT64_MAX;
-  double up_factor_ = 1.10;
-  double down_factor_ = 0.985;
+  double up_factor_ = kDefaultUpFactor;
+  double down_factor_ = kDefaultDownFactor;
   int64_t prev_prediction_error_ = 0;
   uint64_t prev_frame_end_id_ = UINT64_MAX;
   uint64_t prev_frame_end_ts_ = 0;
@@ -278,6 +705,13 @@ private:
   internal::EwmaEstimator latency_;
   internal::EwmaEstimator inv_throughtput_;
   internal::EwmaEstimator proj_correction_;
+  internal::EwmaEstimator stage_latency_[kNumStages] = {
+      internal::EwmaEstimator(0.3), internal::EwmaEstimator(0.3), internal::EwmaEstimator(0.3),
+      internal::EwmaEstimator(0.3), internal::EwmaEstimator(0.3)};
+  internal::EwmaEstimator render_thread_time_ = internal::EwmaEstimator(0.3);
+  internal::EwmaEstimator sync_stall_ = internal::EwmaEstimator(0.3);
+  internal::EwmaEstimator gpu_time_ = internal::EwmaEstimator(0.3);
+  internal::PeriodicityDetector periodicity_;
 
 #ifdef LATENCYFLEX_HAVE_PERFETTO
   uint64_t track_base_ = 0;
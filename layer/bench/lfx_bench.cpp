@@ -0,0 +1,618 @@
+// Copyright 2022 Tatsuyuki Ishi
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// End-to-end benchmark. Runs a synthetic game loop (busy-waiting "simulation" on the CPU, then a
+// busy compute shader on the GPU) and reports the time from each tick to the completion of the
+// frame's GPU work, with the layer active, in placebo mode and absent.
+//
+// Frames are presented to a VK_EXT_headless_surface swapchain, so that the layer's present path is
+// exercised without a display. Works on lavapipe, e.g. with
+// VK_DRIVER_FILES=/usr/share/vulkan/icd.d/lvp_icd.x86_64.json. Without headless surface support,
+// frames are reported to the layer through lfx_BeginPresent/lfx_EndFrame instead.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dlfcn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vulkan/vulkan.h>
+
+#include "latencyflex_layer.h"
+
+#include "busy_comp.h"
+
+#define LAYER_NAME "VK_LAYER_LFX_LatencyFleX"
+
+#define VK_CHECK(expr)                                                                             \
+  do {                                                                                             \
+    VkResult res_ = (expr);                                                                        \
+    if (res_ < 0) {                                                                                \
+      std::cerr << "lfx-bench: " #expr " failed: " << res_ << std::endl;                           \
+      exit(1);                                                                                     \
+    }                                                                                              \
+  } while (0)
+
+namespace {
+const char *kModes[] = {"active", "placebo", "absent"};
+const uint32_t kFramesInFlight = 2;
+const uint32_t kWorkgroupSize = 64;
+
+struct Options {
+  std::string mode = "all";
+  uint32_t frames = 1000;
+  uint32_t warmup = 200;
+  double cpu_ms = 4;
+  uint32_t gpu_iterations = 20000;
+  uint32_t gpu_groups = 64;
+  bool offscreen = false;
+};
+
+typedef void (*PFN_lfx_WaitAndBeginFrame)();
+typedef uint64_t (*PFN_lfx_BeginPresent)();
+typedef void (*PFN_lfx_EndFrame)(uint64_t, uint64_t);
+
+// Entry points of the layer, if it is loaded into the process.
+struct LayerApi {
+  PFN_lfx_WaitAndBeginFrame WaitAndBeginFrame = nullptr;
+  PFN_lfx_BeginPresent BeginPresent = nullptr;
+  PFN_lfx_EndFrame EndFrame = nullptr;
+
+  void Load() {
+    void *mod = dlopen("liblatencyflex_layer.so", RTLD_NOW | RTLD_NOLOAD);
+    if (!mod)
+      return;
+    WaitAndBeginFrame = (PFN_lfx_WaitAndBeginFrame)dlsym(mod, "lfx_WaitAndBeginFrame");
+    BeginPresent = (PFN_lfx_BeginPresent)dlsym(mod, "lfx_BeginPresent");
+    EndFrame = (PFN_lfx_EndFrame)dlsym(mod, "lfx_EndFrame");
+  }
+};
+
+struct Frame {
+  uint64_t index;
+  uint64_t tick;
+  uint64_t layer_frame_id;
+  VkFence fence;
+};
+
+// Waits for frame completion on a dedicated thread, like the layer does, and records the latency
+// of each frame.
+class CompletionThread {
+public:
+  CompletionThread(VkDevice device, const LayerApi &layer)
+      : device_(device), layer_(layer), thread_(&CompletionThread::Worker, this) {}
+
+  ~CompletionThread() {
+    {
+      std::lock_guard<std::mutex> l(lock_);
+      running_ = false;
+    }
+    notify_.notify_all();
+    thread_.join();
+  }
+
+  void Push(const Frame &frame) {
+    std::lock_guard<std::mutex> l(lock_);
+    queue_.push_back(frame);
+    notify_.notify_all();
+  }
+
+  // Wait until frame `index` has completed, after which its fence may be reused.
+  void WaitFor(uint64_t index) {
+    std::unique_lock<std::mutex> l(lock_);
+    notify_.wait(l, [&] { return completed_ > index; });
+  }
+
+  std::vector<uint64_t> latencies;
+  std::vector<uint64_t> completions;
+
+private:
+  void Worker() {
+    while (true) {
+      Frame frame;
+      {
+        std::unique_lock<std::mutex> l(lock_);
+        notify_.wait(l, [&] { return !queue_.empty() || !running_; });
+        if (queue_.empty())
+          return;
+        frame = queue_.front();
+        queue_.pop_front();
+      }
+      VK_CHECK(vkWaitForFences(device_, 1, &frame.fence, VK_TRUE, UINT64_MAX));
+      uint64_t complete = current_time_ns();
+      if (frame.layer_frame_id != 0 && layer_.EndFrame)
+        layer_.EndFrame(frame.layer_frame_id, complete);
+      std::lock_guard<std::mutex> l(lock_);
+      latencies.push_back(complete - frame.tick);
+      completions.push_back(complete);
+      completed_ = frame.index + 1;
+      notify_.notify_all();
+    }
+  }
+
+  VkDevice device_;
+  const LayerApi &layer_;
+  std::mutex lock_;
+  std::condition_variable notify_;
+  std::deque<Frame> queue_;
+  uint64_t completed_ = 0;
+  bool running_ = true;
+  std::thread thread_;
+};
+
+bool HasExtension(const std::vector<VkExtensionProperties> &extensions, const char *name) {
+  return std::any_of(extensions.begin(), extensions.end(), [&](const VkExtensionProperties &ext) {
+    return !strcmp(ext.extensionName, name);
+  });
+}
+
+void Spin(double ms) {
+  uint64_t until = current_time_ns() + (uint64_t)(ms * 1000000);
+  while (current_time_ns() < until) {
+  }
+}
+
+double Percentile(std::vector<uint64_t> values, double p) {
+  std::sort(values.begin(), values.end());
+  return values[std::min(values.size() - 1, (size_t)(p * values.size()))] / 1000000.;
+}
+
+// Run the benchmark in the current process, with the layer configured through the environment.
+int Run(const Options &opts) {
+  uint32_t count = 0;
+  vkEnumerateInstanceExtensionProperties(nullptr, &count, nullptr);
+  std::vector<VkExtensionProperties> instance_exts(count);
+  vkEnumerateInstanceExtensionProperties(nullptr, &count, instance_exts.data());
+  bool headless = !opts.offscreen &&
+                  HasExtension(instance_exts, VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME) &&
+                  HasExtension(instance_exts, VK_KHR_SURFACE_EXTENSION_NAME);
+
+  VkApplicationInfo appInfo{};
+  appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+  appInfo.pApplicationName = "lfx-bench";
+  appInfo.apiVersion = VK_API_VERSION_1_1;
+  std::vector<const char *> instance_ext_names;
+  if (headless) {
+    instance_ext_names.push_back(VK_KHR_SURFACE_EXTENSION_NAME);
+    instance_ext_names.push_back(VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME);
+  }
+  VkInstanceCreateInfo instanceInfo{};
+  instanceInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+  instanceInfo.pApplicationInfo = &appInfo;
+  instanceInfo.enabledExtensionCount = instance_ext_names.size();
+  instanceInfo.ppEnabledExtensionNames = instance_ext_names.data();
+  VkInstance instance;
+  VK_CHECK(vkCreateInstance(&instanceInfo, nullptr, &instance));
+
+  LayerApi layer;
+  layer.Load();
+
+  count = 0;
+  vkEnumeratePhysicalDevices(instance, &count, nullptr);
+  if (count == 0) {
+    std::cerr << "lfx-bench: No Vulkan device found" << std::endl;
+    return 1;
+  }
+  std::vector<VkPhysicalDevice> physical_devices(count);
+  vkEnumeratePhysicalDevices(instance, &count, physical_devices.data());
+  VkPhysicalDevice physical_device = physical_devices[0];
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(physical_device, &props);
+
+  count = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &count, nullptr);
+  std::vector<VkQueueFamilyProperties> families(count);
+  vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &count, families.data());
+  uint32_t family = UINT32_MAX;
+  for (uint32_t i = 0; i < count && family == UINT32_MAX; i++) {
+    if (families[i].queueFlags & VK_QUEUE_COMPUTE_BIT)
+      family = i;
+  }
+  if (family == UINT32_MAX) {
+    std::cerr << "lfx-bench: No compute queue found" << std::endl;
+    return 1;
+  }
+
+  VkSurfaceKHR surface = VK_NULL_HANDLE;
+  if (headless) {
+    auto createHeadlessSurface = (PFN_vkCreateHeadlessSurfaceEXT)vkGetInstanceProcAddr(
+        instance, "vkCreateHeadlessSurfaceEXT");
+    VkHeadlessSurfaceCreateInfoEXT surfaceInfo{};
+    surfaceInfo.sType = VK_STRUCTURE_TYPE_HEADLESS_SURFACE_CREATE_INFO_EXT;
+    VK_CHECK(createHeadlessSurface(instance, &surfaceInfo, nullptr, &surface));
+    VkBool32 supported = VK_FALSE;
+    vkGetPhysicalDeviceSurfaceSupportKHR(physical_device, family, surface, &supported);
+    if (!supported) {
+      std::cerr << "lfx-bench: Queue family cannot present, running offscreen" << std::endl;
+      vkDestroySurfaceKHR(instance, surface, nullptr);
+      surface = VK_NULL_HANDLE;
+      headless = false;
+    }
+  }
+
+  float priority = 1.0f;
+  VkDeviceQueueCreateInfo queueInfo{};
+  queueInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+  queueInfo.queueFamilyIndex = family;
+  queueInfo.queueCount = 1;
+  queueInfo.pQueuePriorities = &priority;
+  const char *swapchain_ext = VK_KHR_SWAPCHAIN_EXTENSION_NAME;
+  VkDeviceCreateInfo deviceInfo{};
+  deviceInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+  deviceInfo.queueCreateInfoCount = 1;
+  deviceInfo.pQueueCreateInfos = &queueInfo;
+  deviceInfo.enabledExtensionCount = headless ? 1 : 0;
+  deviceInfo.ppEnabledExtensionNames = &swapchain_ext;
+  VkDevice device;
+  VK_CHECK(vkCreateDevice(physical_device, &deviceInfo, nullptr, &device));
+  VkQueue queue;
+  vkGetDeviceQueue(device, family, 0, &queue);
+
+  // Swapchain, only used to drive the present path. The images are transitioned for
+  // presentation but otherwise left untouched.
+  VkSwapchainKHR swapchain = VK_NULL_HANDLE;
+  std::vector<VkImage> images;
+  if (headless) {
+    VkSurfaceCapabilitiesKHR caps;
+    VK_CHECK(vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physical_device, surface, &caps));
+    count = 0;
+    vkGetPhysicalDeviceSurfaceFormatsKHR(physical_device, surface, &count, nullptr);
+    std::vector<VkSurfaceFormatKHR> formats(count);
+    vkGetPhysicalDeviceSurfaceFormatsKHR(physical_device, surface, &count, formats.data());
+    count = 0;
+    vkGetPhysicalDeviceSurfacePresentModesKHR(physical_device, surface, &count, nullptr);
+    std::vector<VkPresentModeKHR> modes(count);
+    vkGetPhysicalDeviceSurfacePresentModesKHR(physical_device, surface, &count, modes.data());
+    bool immediate = std::find(modes.begin(), modes.end(), VK_PRESENT_MODE_IMMEDIATE_KHR) !=
+                     modes.end();
+
+    VkSwapchainCreateInfoKHR swapchainInfo{};
+    swapchainInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
+    swapchainInfo.surface = surface;
+    swapchainInfo.minImageCount = std::max(caps.minImageCount, kFramesInFlight + 1);
+    if (caps.maxImageCount)
+      swapchainInfo.minImageCount = std::min(swapchainInfo.minImageCount, caps.maxImageCount);
+    swapchainInfo.imageFormat = formats[0].format;
+    swapchainInfo.imageColorSpace = formats[0].colorSpace;
+    swapchainInfo.imageExtent = caps.currentExtent.width == UINT32_MAX ? VkExtent2D{64, 64}
+                                                                       : caps.currentExtent;
+    swapchainInfo.imageArrayLayers = 1;
+    swapchainInfo.imageUsage = VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    swapchainInfo.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    swapchainInfo.preTransform = caps.currentTransform;
+    swapchainInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
+    swapchainInfo.presentMode = immediate ? VK_PRESENT_MODE_IMMEDIATE_KHR : VK_PRESENT_MODE_FIFO_KHR;
+    swapchainInfo.clipped = VK_TRUE;
+    VK_CHECK(vkCreateSwapchainKHR(device, &swapchainInfo, nullptr, &swapchain));
+    count = 0;
+    vkGetSwapchainImagesKHR(device, swapchain, &count, nullptr);
+    images.resize(count);
+    vkGetSwapchainImagesKHR(device, swapchain, &count, images.data());
+  }
+
+  // Output buffer of the busy shader. Its contents are never read.
+  VkBufferCreateInfo bufferInfo{};
+  bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  bufferInfo.size = opts.gpu_groups * kWorkgroupSize * sizeof(uint32_t);
+  bufferInfo.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  VkBuffer buffer;
+  VK_CHECK(vkCreateBuffer(device, &bufferInfo, nullptr, &buffer));
+  VkMemoryRequirements reqs;
+  vkGetBufferMemoryRequirements(device, buffer, &reqs);
+  VkPhysicalDeviceMemoryProperties mem_props;
+  vkGetPhysicalDeviceMemoryProperties(physical_device, &mem_props);
+  VkMemoryAllocateInfo allocInfo{};
+  allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocInfo.allocationSize = reqs.size;
+  allocInfo.memoryTypeIndex = __builtin_ctz(reqs.memoryTypeBits);
+  VkDeviceMemory memory;
+  VK_CHECK(vkAllocateMemory(device, &allocInfo, nullptr, &memory));
+  VK_CHECK(vkBindBufferMemory(device, buffer, memory, 0));
+
+  VkDescriptorSetLayoutBinding binding{};
+  binding.binding = 0;
+  binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  binding.descriptorCount = 1;
+  binding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  VkDescriptorSetLayoutCreateInfo setLayoutInfo{};
+  setLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  setLayoutInfo.bindingCount = 1;
+  setLayoutInfo.pBindings = &binding;
+  VkDescriptorSetLayout set_layout;
+  VK_CHECK(vkCreateDescriptorSetLayout(device, &setLayoutInfo, nullptr, &set_layout));
+  VkPushConstantRange pushRange{VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(uint32_t)};
+  VkPipelineLayoutCreateInfo layoutInfo{};
+  layoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  layoutInfo.setLayoutCount = 1;
+  layoutInfo.pSetLayouts = &set_layout;
+  layoutInfo.pushConstantRangeCount = 1;
+  layoutInfo.pPushConstantRanges = &pushRange;
+  VkPipelineLayout pipeline_layout;
+  VK_CHECK(vkCreatePipelineLayout(device, &layoutInfo, nullptr, &pipeline_layout));
+
+  VkShaderModuleCreateInfo moduleInfo{};
+  moduleInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+  moduleInfo.codeSize = sizeof(busy_comp);
+  moduleInfo.pCode = busy_comp;
+  VkShaderModule module;
+  VK_CHECK(vkCreateShaderModule(device, &moduleInfo, nullptr, &module));
+  VkComputePipelineCreateInfo pipelineInfo{};
+  pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  pipelineInfo.stage.module = module;
+  pipelineInfo.stage.pName = "main";
+  pipelineInfo.layout = pipeline_layout;
+  VkPipeline pipeline;
+  VK_CHECK(vkCreateComputePipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &pipeline));
+
+  VkDescriptorPoolSize poolSize{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1};
+  VkDescriptorPoolCreateInfo descPoolInfo{};
+  descPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  descPoolInfo.maxSets = 1;
+  descPoolInfo.poolSizeCount = 1;
+  descPoolInfo.pPoolSizes = &poolSize;
+  VkDescriptorPool desc_pool;
+  VK_CHECK(vkCreateDescriptorPool(device, &descPoolInfo, nullptr, &desc_pool));
+  VkDescriptorSetAllocateInfo setInfo{};
+  setInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  setInfo.descriptorPool = desc_pool;
+  setInfo.descriptorSetCount = 1;
+  setInfo.pSetLayouts = &set_layout;
+  VkDescriptorSet set;
+  VK_CHECK(vkAllocateDescriptorSets(device, &setInfo, &set));
+  VkDescriptorBufferInfo descBuffer{buffer, 0, VK_WHOLE_SIZE};
+  VkWriteDescriptorSet write{};
+  write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  write.dstSet = set;
+  write.descriptorCount = 1;
+  write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  write.pBufferInfo = &descBuffer;
+  vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
+
+  VkCommandPoolCreateInfo cmdPoolInfo{};
+  cmdPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  cmdPoolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  cmdPoolInfo.queueFamilyIndex = family;
+  VkCommandPool cmd_pool;
+  VK_CHECK(vkCreateCommandPool(device, &cmdPoolInfo, nullptr, &cmd_pool));
+  VkCommandBufferAllocateInfo cmdInfo{};
+  cmdInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  cmdInfo.commandPool = cmd_pool;
+  cmdInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  cmdInfo.commandBufferCount = kFramesInFlight;
+  VkCommandBuffer cmds[kFramesInFlight];
+  VK_CHECK(vkAllocateCommandBuffers(device, &cmdInfo, cmds));
+
+  VkFence fences[kFramesInFlight];
+  VkSemaphore acquired[kFramesInFlight];
+  std::vector<VkSemaphore> rendered(images.size());
+  VkFenceCreateInfo fenceInfo{};
+  fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  VkSemaphoreCreateInfo semInfo{};
+  semInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  for (uint32_t i = 0; i < kFramesInFlight; i++) {
+    VK_CHECK(vkCreateFence(device, &fenceInfo, nullptr, &fences[i]));
+    VK_CHECK(vkCreateSemaphore(device, &semInfo, nullptr, &acquired[i]));
+  }
+  for (VkSemaphore &sem : rendered)
+    VK_CHECK(vkCreateSemaphore(device, &semInfo, nullptr, &sem));
+
+  uint64_t begin_ts = 0;
+  {
+    CompletionThread completion(device, layer);
+    for (uint64_t i = 0; i < opts.frames; i++) {
+      uint32_t slot = i % kFramesInFlight;
+      // Backpressure: at most kFramesInFlight frames are queued.
+      if (i >= kFramesInFlight) {
+        completion.WaitFor(i - kFramesInFlight);
+        VK_CHECK(vkResetFences(device, 1, &fences[slot]));
+      }
+
+      if (layer.WaitAndBeginFrame)
+        layer.WaitAndBeginFrame();
+      uint64_t tick = current_time_ns();
+      if (i == opts.warmup)
+        begin_ts = tick;
+      Spin(opts.cpu_ms);
+
+      uint32_t image = 0;
+      if (headless)
+        VK_CHECK(vkAcquireNextImageKHR(device, swapchain, UINT64_MAX, acquired[slot],
+                                       VK_NULL_HANDLE, &image));
+
+      VkCommandBuffer cmd = cmds[slot];
+      VkCommandBufferBeginInfo beginInfo{};
+      beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+      beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+      VK_CHECK(vkBeginCommandBuffer(cmd, &beginInfo));
+      vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+      vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline_layout, 0, 1, &set, 0,
+                              nullptr);
+      vkCmdPushConstants(cmd, pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(uint32_t),
+                         &opts.gpu_iterations);
+      vkCmdDispatch(cmd, opts.gpu_groups, 1, 1);
+      if (headless) {
+        VkImageMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        barrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = images[image];
+        barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                             VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1,
+                             &barrier);
+      }
+      VK_CHECK(vkEndCommandBuffer(cmd));
+
+      VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+      VkSubmitInfo submitInfo{};
+      submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+      submitInfo.commandBufferCount = 1;
+      submitInfo.pCommandBuffers = &cmd;
+      if (headless) {
+        submitInfo.waitSemaphoreCount = 1;
+        submitInfo.pWaitSemaphores = &acquired[slot];
+        submitInfo.pWaitDstStageMask = &wait_stage;
+        submitInfo.signalSemaphoreCount = 1;
+        submitInfo.pSignalSemaphores = &rendered[image];
+      }
+      VK_CHECK(vkQueueSubmit(queue, 1, &submitInfo, fences[slot]));
+
+      uint64_t layer_frame_id = 0;
+      if (headless) {
+        VkPresentInfoKHR presentInfo{};
+        presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+        presentInfo.waitSemaphoreCount = 1;
+        presentInfo.pWaitSemaphores = &rendered[image];
+        presentInfo.swapchainCount = 1;
+        presentInfo.pSwapchains = &swapchain;
+        presentInfo.pImageIndices = &image;
+        VK_CHECK(vkQueuePresentKHR(queue, &presentInfo));
+      } else if (layer.BeginPresent) {
+        layer_frame_id = layer.BeginPresent();
+      }
+      completion.Push({i, tick, layer_frame_id, fences[slot]});
+    }
+    completion.WaitFor(opts.frames - 1);
+
+    std::vector<uint64_t> latencies(completion.latencies.begin() + opts.warmup,
+                                    completion.latencies.end());
+    double elapsed = (completion.completions.back() - begin_ts) / 1000000000.;
+    double mean = 0;
+    for (uint64_t latency : latencies)
+      mean += latency / 1000000.;
+    mean /= latencies.size();
+    std::cout << props.deviceName << (headless ? " (headless surface)" : " (offscreen)")
+              << ": latency mean=" << mean << "ms p50=" << Percentile(latencies, 0.5)
+              << "ms p99=" << Percentile(latencies, 0.99)
+              << "ms, throughput=" << latencies.size() / elapsed << " FPS" << std::endl;
+  }
+
+  vkDeviceWaitIdle(device);
+  for (VkSemaphore sem : rendered)
+    vkDestroySemaphore(device, sem, nullptr);
+  for (uint32_t i = 0; i < kFramesInFlight; i++) {
+    vkDestroyFence(device, fences[i], nullptr);
+    vkDestroySemaphore(device, acquired[i], nullptr);
+  }
+  vkDestroyCommandPool(device, cmd_pool, nullptr);
+  vkDestroyDescriptorPool(device, desc_pool, nullptr);
+  vkDestroyPipeline(device, pipeline, nullptr);
+  vkDestroyShaderModule(device, module, nullptr);
+  vkDestroyPipelineLayout(device, pipeline_layout, nullptr);
+  vkDestroyDescriptorSetLayout(device, set_layout, nullptr);
+  vkDestroyBuffer(device, buffer, nullptr);
+  vkFreeMemory(device, memory, nullptr);
+  if (swapchain != VK_NULL_HANDLE)
+    vkDestroySwapchainKHR(device, swapchain, nullptr);
+  vkDestroyDevice(device, nullptr);
+  if (surface != VK_NULL_HANDLE)
+    vkDestroySurfaceKHR(instance, surface, nullptr);
+  vkDestroyInstance(instance, nullptr);
+  return 0;
+}
+
+// Select the mode through the layer's enable/disable environment variables. Must happen before the
+// loader reads them, i.e. before the first Vulkan call.
+void SetModeEnvironment(const std::string &mode) {
+  if (mode == "absent") {
+    unsetenv("LFX");
+    setenv("DISABLE_LFX", "1", 1);
+  } else {
+    setenv("LFX", "1", 1);
+    unsetenv("DISABLE_LFX");
+    setenv("LFX_PLACEBO", mode == "placebo" ? "1" : "0", 1);
+  }
+}
+
+void Usage() {
+  std::cerr << "Usage: lfx-bench [options]\n"
+               "  --mode MODE        active, placebo, absent or all (default: all)\n"
+               "  --frames N         Frames to run, including warm-up (default: 1000)\n"
+               "  --warmup N         Frames excluded from the results (default: 200)\n"
+               "  --cpu-ms MS        Simulation time per frame (default: 4)\n"
+               "  --gpu-iterations N Iterations of the busy shader per invocation (default: 20000)\n"
+               "  --gpu-groups N     Workgroups of 64 invocations dispatched per frame (default: 64)\n"
+               "  --offscreen        Do not present, report frames through lfx_BeginPresent\n";
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  Options opts;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--mode" && has_value)
+      opts.mode = argv[++i];
+    else if (arg == "--frames" && has_value)
+      opts.frames = std::stoul(argv[++i]);
+    else if (arg == "--warmup" && has_value)
+      opts.warmup = std::stoul(argv[++i]);
+    else if (arg == "--cpu-ms" && has_value)
+      opts.cpu_ms = std::stod(argv[++i]);
+    else if (arg == "--gpu-iterations" && has_value)
+      opts.gpu_iterations = std::stoul(argv[++i]);
+    else if (arg == "--gpu-groups" && has_value)
+      opts.gpu_groups = std::stoul(argv[++i]);
+    else if (arg == "--offscreen")
+      opts.offscreen = true;
+    else if (arg == "--help") {
+      Usage();
+      return 0;
+    } else {
+      Usage();
+      return 1;
+    }
+  }
+  if (opts.warmup >= opts.frames) {
+    std::cerr << "lfx-bench: --warmup must be less than --frames" << std::endl;
+    return 1;
+  }
+
+  if (opts.mode != "all") {
+    if (std::find(std::begin(kModes), std::end(kModes), opts.mode) == std::end(kModes)) {
+      Usage();
+      return 1;
+    }
+    SetModeEnvironment(opts.mode);
+    return Run(opts);
+  }
+
+  // The layer is loaded once per process, so run each mode in a child process.
+  for (const char *mode : kModes) {
+    std::cout << mode << ": " << std::flush;
+    pid_t pid = fork();
+    if (pid == 0) {
+      SetModeEnvironment(mode);
+      exit(Run(opts));
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      return 1;
+  }
+  return 0;
+}
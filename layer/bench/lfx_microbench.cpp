@@ -0,0 +1,365 @@
+// Copyright 2022 Tatsuyuki Ishi
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Per-call overhead of the core API and of the layer's intercepted swapchain functions.
+//
+// The layer is driven directly through its GetProcAddr entry points, with a stub standing in for
+// the next layer in the chain. The stub completes all work instantly, so the measured time is the
+// layer's own overhead. Exits with a failure status if the median exceeds --max-median-ns, which
+// the meson benchmark targets use to catch regressions.
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <vulkan/vk_layer.h>
+#include <vulkan/vulkan.h>
+
+#include "latencyflex.h"
+#include "latencyflex_layer.h"
+
+extern "C" PFN_vkVoidFunction VKAPI_CALL lfx_GetInstanceProcAddr(VkInstance instance,
+                                                                 const char *pName);
+extern "C" PFN_vkVoidFunction VKAPI_CALL lfx_GetDeviceProcAddr(VkDevice device,
+                                                               const char *pName);
+
+namespace {
+// Dispatchable handles start with the loader's dispatch pointer, which the layer uses as the key
+// of its maps. Child objects share the key of their parent.
+struct StubObject {
+  void *key;
+};
+
+StubObject instance_key_holder;
+StubObject device_key_holder;
+StubObject stub_instance{&instance_key_holder};
+StubObject stub_physical_device{&instance_key_holder};
+StubObject stub_device{&device_key_holder};
+std::vector<StubObject> stub_queues;
+std::atomic<uint64_t> next_fence{1};
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Stub of the next layer
+
+VKAPI_ATTR VkResult VKAPI_CALL StubCreateInstance(const VkInstanceCreateInfo *,
+                                                  const VkAllocationCallbacks *,
+                                                  VkInstance *pInstance) {
+  *pInstance = (VkInstance)&stub_instance;
+  return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL StubDestroyInstance(VkInstance, const VkAllocationCallbacks *) {}
+
+VKAPI_ATTR VkResult VKAPI_CALL StubEnumerateDeviceExtensionProperties(VkPhysicalDevice,
+                                                                      const char *,
+                                                                      uint32_t *pPropertyCount,
+                                                                      VkExtensionProperties *) {
+  *pPropertyCount = 0;
+  return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL StubGetPhysicalDeviceQueueFamilyProperties(
+    VkPhysicalDevice, uint32_t *pCount, VkQueueFamilyProperties *pProperties) {
+  if (pProperties) {
+    *pProperties = {};
+    pProperties->queueFlags = VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT;
+    pProperties->queueCount = stub_queues.size();
+  }
+  *pCount = 1;
+}
+
+VKAPI_ATTR void VKAPI_CALL StubGetPhysicalDeviceProperties(VkPhysicalDevice,
+                                                           VkPhysicalDeviceProperties *pProps) {
+  *pProps = {};
+  strcpy(pProps->deviceName, "lfx-microbench stub");
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL StubCreateDevice(VkPhysicalDevice, const VkDeviceCreateInfo *,
+                                                const VkAllocationCallbacks *,
+                                                VkDevice *pDevice) {
+  *pDevice = (VkDevice)&stub_device;
+  return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL StubDestroyDevice(VkDevice, const VkAllocationCallbacks *) {}
+
+VKAPI_ATTR void VKAPI_CALL StubGetDeviceQueue(VkDevice, uint32_t, uint32_t queueIndex,
+                                              VkQueue *pQueue) {
+  *pQueue = (VkQueue)&stub_queues[queueIndex];
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL StubCreateFence(VkDevice, const VkFenceCreateInfo *,
+                                               const VkAllocationCallbacks *, VkFence *pFence) {
+  *pFence = (VkFence)next_fence.fetch_add(1);
+  return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL StubDestroyFence(VkDevice, VkFence, const VkAllocationCallbacks *) {}
+
+VKAPI_ATTR VkResult VKAPI_CALL StubWaitForFences(VkDevice, uint32_t, const VkFence *, VkBool32,
+                                                 uint64_t) {
+  return VK_SUCCESS;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL StubQueueSubmit(VkQueue, uint32_t, const VkSubmitInfo *, VkFence) {
+  return VK_SUCCESS;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL StubQueuePresentKHR(VkQueue, const VkPresentInfoKHR *) {
+  return VK_SUCCESS;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL StubAcquireNextImageKHR(VkDevice, VkSwapchainKHR, uint64_t,
+                                                       VkSemaphore, VkFence,
+                                                       uint32_t *pImageIndex) {
+  *pImageIndex = 0;
+  return VK_SUCCESS;
+}
+
+#define STUB_FUNCTION(func)                                                                        \
+  if (!strcmp(pName, "vk" #func))                                                                  \
+  return (PFN_vkVoidFunction)&Stub##func
+
+VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL StubGetDeviceProcAddr(VkDevice, const char *pName);
+
+VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL StubGetInstanceProcAddr(VkInstance, const char *pName) {
+  STUB_FUNCTION(GetInstanceProcAddr);
+  STUB_FUNCTION(CreateInstance);
+  STUB_FUNCTION(DestroyInstance);
+  STUB_FUNCTION(EnumerateDeviceExtensionProperties);
+  STUB_FUNCTION(GetPhysicalDeviceQueueFamilyProperties);
+  STUB_FUNCTION(GetPhysicalDeviceProperties);
+  STUB_FUNCTION(CreateDevice);
+  return StubGetDeviceProcAddr(VK_NULL_HANDLE, pName);
+}
+
+// Functions the layer does not need for this benchmark are reported as unsupported.
+VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL StubGetDeviceProcAddr(VkDevice, const char *pName) {
+  STUB_FUNCTION(GetDeviceProcAddr);
+  STUB_FUNCTION(DestroyDevice);
+  STUB_FUNCTION(GetDeviceQueue);
+  STUB_FUNCTION(CreateFence);
+  STUB_FUNCTION(DestroyFence);
+  STUB_FUNCTION(WaitForFences);
+  STUB_FUNCTION(QueueSubmit);
+  STUB_FUNCTION(QueuePresentKHR);
+  STUB_FUNCTION(AcquireNextImageKHR);
+  return nullptr;
+}
+
+#undef STUB_FUNCTION
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Measurement
+
+struct Options {
+  std::string suite;
+  uint32_t iterations = 100000;
+  uint32_t threads = 1;
+  double max_median_ns = 0;
+};
+
+// Per-call durations of one benchmarked function.
+struct Samples {
+  const char *name;
+  std::vector<uint64_t> durations;
+
+  uint64_t Percentile(double p) const {
+    std::vector<uint64_t> sorted = durations;
+    std::sort(sorted.begin(), sorted.end());
+    return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+  }
+};
+
+template <typename F> void Measure(Samples *samples, F &&f) {
+  uint64_t begin = current_time_ns();
+  f();
+  samples->durations.push_back(current_time_ns() - begin);
+}
+
+// Report the distribution of each function, and check the median against the threshold.
+bool Report(const Options &opts, const std::vector<Samples> &all) {
+  bool ok = true;
+  for (const Samples &samples : all) {
+    uint64_t median = samples.Percentile(0.5);
+    std::cout << samples.name << " (" << opts.threads << " threads): p50=" << median
+              << "ns p90=" << samples.Percentile(0.9) << "ns p99=" << samples.Percentile(0.99)
+              << "ns p99.9=" << samples.Percentile(0.999) << "ns" << std::endl;
+    if (opts.max_median_ns != 0 && median > opts.max_median_ns) {
+      std::cerr << "lfx-microbench: " << samples.name << " median " << median
+                << "ns exceeds the threshold of " << opts.max_median_ns << "ns" << std::endl;
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+// The controller on its own, with a synthetic clock so that nothing sleeps. Not thread-safe, so
+// there is no contended variant; the layer serializes all calls with its lock.
+bool RunCore(const Options &opts) {
+  const uint64_t kFrameTime = 10000000;
+  const uint64_t kLatency = 25000000;
+  lfx::LatencyFleX manager;
+  std::vector<Samples> samples{{"GetWaitTarget", {}}, {"BeginFrame", {}}, {"EndFrame", {}}};
+  for (Samples &s : samples)
+    s.durations.reserve(opts.iterations);
+  uint64_t ts = kLatency;
+  for (uint64_t frame_id = 1; frame_id <= opts.iterations; frame_id++) {
+    uint64_t target;
+    Measure(&samples[0], [&] { target = manager.GetWaitTarget(frame_id); });
+    ts = std::max(ts + kFrameTime, target);
+    Measure(&samples[1], [&] { manager.BeginFrame(frame_id, target, ts); });
+    uint64_t latency, frame_time;
+    Measure(&samples[2], [&] { manager.EndFrame(frame_id, ts + kLatency, &latency, &frame_time); });
+  }
+  return Report(opts, samples);
+}
+
+// The intercepted vkAcquireNextImageKHR and vkQueuePresentKHR, called from `opts.threads` render
+// threads at once, each with its own queue. The layer's completion thread runs concurrently.
+bool RunLayer(const Options &opts) {
+  stub_queues.assign(opts.threads, StubObject{&device_key_holder});
+
+  VkLayerInstanceLink instance_link{};
+  instance_link.pfnNextGetInstanceProcAddr = StubGetInstanceProcAddr;
+  VkLayerInstanceCreateInfo instance_chain{};
+  instance_chain.sType = VK_STRUCTURE_TYPE_LOADER_INSTANCE_CREATE_INFO;
+  instance_chain.function = VK_LAYER_LINK_INFO;
+  instance_chain.u.pLayerInfo = &instance_link;
+  VkInstanceCreateInfo instanceInfo{};
+  instanceInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+  instanceInfo.pNext = &instance_chain;
+  auto createInstance =
+      (PFN_vkCreateInstance)lfx_GetInstanceProcAddr(VK_NULL_HANDLE, "vkCreateInstance");
+  VkInstance instance;
+  if (createInstance(&instanceInfo, nullptr, &instance) != VK_SUCCESS) {
+    std::cerr << "lfx-microbench: vkCreateInstance failed" << std::endl;
+    return false;
+  }
+
+  VkLayerDeviceLink device_link{};
+  device_link.pfnNextGetInstanceProcAddr = StubGetInstanceProcAddr;
+  device_link.pfnNextGetDeviceProcAddr = StubGetDeviceProcAddr;
+  VkLayerDeviceCreateInfo device_chain{};
+  device_chain.sType = VK_STRUCTURE_TYPE_LOADER_DEVICE_CREATE_INFO;
+  device_chain.function = VK_LAYER_LINK_INFO;
+  device_chain.u.pLayerInfo = &device_link;
+  VkDeviceCreateInfo deviceInfo{};
+  deviceInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+  deviceInfo.pNext = &device_chain;
+  auto createDevice = (PFN_vkCreateDevice)lfx_GetInstanceProcAddr(instance, "vkCreateDevice");
+  VkDevice device;
+  if (createDevice((VkPhysicalDevice)&stub_physical_device, &deviceInfo, nullptr, &device) !=
+      VK_SUCCESS) {
+    std::cerr << "lfx-microbench: vkCreateDevice failed" << std::endl;
+    return false;
+  }
+
+  auto getDeviceQueue = (PFN_vkGetDeviceQueue)lfx_GetDeviceProcAddr(device, "vkGetDeviceQueue");
+  auto acquireNextImage =
+      (PFN_vkAcquireNextImageKHR)lfx_GetDeviceProcAddr(device, "vkAcquireNextImageKHR");
+  auto queuePresent = (PFN_vkQueuePresentKHR)lfx_GetDeviceProcAddr(device, "vkQueuePresentKHR");
+
+  std::vector<std::vector<Samples>> per_thread(opts.threads);
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < opts.threads; t++) {
+    VkQueue queue;
+    getDeviceQueue(device, 0, t, &queue);
+    per_thread[t] = {{"vkAcquireNextImageKHR", {}}, {"vkQueuePresentKHR", {}}};
+    threads.emplace_back([&, t, queue] {
+      std::vector<Samples> &samples = per_thread[t];
+      for (Samples &s : samples)
+        s.durations.reserve(opts.iterations);
+      VkSwapchainKHR swapchain = VK_NULL_HANDLE;
+      uint32_t image;
+      VkPresentInfoKHR presentInfo{};
+      presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+      presentInfo.swapchainCount = 1;
+      presentInfo.pSwapchains = &swapchain;
+      presentInfo.pImageIndices = &image;
+      for (uint32_t i = 0; i < opts.iterations; i++) {
+        Measure(&samples[0], [&] {
+          acquireNextImage(device, swapchain, UINT64_MAX, VK_NULL_HANDLE, VK_NULL_HANDLE, &image);
+        });
+        Measure(&samples[1], [&] { queuePresent(queue, &presentInfo); });
+      }
+    });
+  }
+  for (std::thread &thread : threads)
+    thread.join();
+
+  // Merge the threads' samples, so that the distribution covers all callers.
+  std::vector<Samples> samples = per_thread[0];
+  for (uint32_t t = 1; t < opts.threads; t++) {
+    for (size_t i = 0; i < samples.size(); i++) {
+      samples[i].durations.insert(samples[i].durations.end(), per_thread[t][i].durations.begin(),
+                                  per_thread[t][i].durations.end());
+    }
+  }
+
+  ((PFN_vkDestroyDevice)lfx_GetDeviceProcAddr(device, "vkDestroyDevice"))(device, nullptr);
+  ((PFN_vkDestroyInstance)lfx_GetInstanceProcAddr(instance, "vkDestroyInstance"))(instance,
+                                                                                   nullptr);
+  return Report(opts, samples);
+}
+
+void Usage() {
+  std::cerr << "Usage: lfx-microbench core|layer [options]\n"
+               "  --iterations N     Calls per function and thread (default: 100000)\n"
+               "  --threads N        Render threads calling into the layer (default: 1)\n"
+               "  --max-median-ns NS Fail if the median of any function exceeds NS\n";
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    Usage();
+    return 1;
+  }
+  Options opts;
+  opts.suite = argv[1];
+  for (int i = 2; i < argc; i++) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--iterations" && has_value)
+      opts.iterations = std::stoul(argv[++i]);
+    else if (arg == "--threads" && has_value)
+      opts.threads = std::stoul(argv[++i]);
+    else if (arg == "--max-median-ns" && has_value)
+      opts.max_median_ns = std::stod(argv[++i]);
+    else {
+      Usage();
+      return 1;
+    }
+  }
+  if (opts.iterations == 0 || opts.threads == 0) {
+    Usage();
+    return 1;
+  }
+
+  bool ok;
+  if (opts.suite == "core") {
+    ok = RunCore(opts);
+  } else if (opts.suite == "layer") {
+    ok = RunLayer(opts);
+  } else {
+    Usage();
+    return 1;
+  }
+  return ok ? 0 : 1;
+}
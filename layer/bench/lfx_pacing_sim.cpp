@@ -0,0 +1,152 @@
+// Copyright 2022 Tatsuyuki Ishi
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Pacing of the core controller against a discrete model of a game: a CPU stage, then a GPU stage,
+// optionally presenting in FIFO mode so that acquiring a swapchain image throttles the game to the
+// refresh rate. Each scenario checks the resulting latency and frame time against bounds, which the
+// meson test target uses to catch pacing regressions.
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <vector>
+
+#include "latencyflex.h"
+
+namespace {
+const uint64_t kMs = 1000000;
+
+struct Pipeline {
+  std::function<uint64_t(uint64_t)> cpu_time;
+  std::function<uint64_t(uint64_t)> gpu_time;
+  // Zero for immediate presentation.
+  uint64_t refresh_interval = 0;
+  uint64_t swapchain_images = 3;
+};
+
+struct Result {
+  double latency = 0;
+  double frame_time = 0;
+  // The first frame after `settle_after` from which the frame time estimate stays within 10% of
+  // `settled_frame_time` for 5 frames.
+  uint64_t settled_frame = 0;
+};
+
+// Run `frames` frames, and average over the ones after `measure_after`.
+Result Run(const Pipeline &pipeline, uint64_t frames, uint64_t measure_after,
+           uint64_t settle_after = 0, uint64_t settled_frame_time = 0) {
+  lfx::LatencyFleX manager;
+  std::vector<uint64_t> begin(frames + 1), complete(frames + 1), display(frames + 1);
+  std::deque<uint64_t> pending;
+  uint64_t now = 1000 * kMs;
+  uint64_t gpu_free = now;
+  Result result;
+  uint64_t measured = 0, settled_streak = 0;
+  auto complete_until = [&](uint64_t ts) {
+    while (!pending.empty() && complete[pending.front()] <= ts) {
+      uint64_t latency, frame_time;
+      manager.EndFrame(pending.front(), complete[pending.front()], &latency, &frame_time);
+      pending.pop_front();
+    }
+  };
+  for (uint64_t id = 1; id <= frames; id++) {
+    uint64_t target = manager.GetWaitTarget(id);
+    uint64_t wake = std::max(now, target);
+    complete_until(wake);
+    manager.BeginFrame(id, target, wake);
+    now = begin[id] = wake;
+    now += pipeline.cpu_time(id);
+    // Acquire blocks until the image presented `swapchain_images - 1` frames ago is replaced.
+    if (pipeline.refresh_interval != 0 && id >= pipeline.swapchain_images)
+      now = std::max(now, display[id - pipeline.swapchain_images + 1]);
+    // At most two frames in flight.
+    if (id > 2)
+      now = std::max(now, complete[id - 2]);
+    gpu_free = complete[id] = std::max(now, gpu_free) + pipeline.gpu_time(id);
+    display[id] = complete[id];
+    if (pipeline.refresh_interval != 0) {
+      uint64_t earliest = std::max(complete[id], id > 1 ? display[id - 1] + 1 : 0);
+      display[id] = (earliest + pipeline.refresh_interval - 1) / pipeline.refresh_interval *
+                    pipeline.refresh_interval;
+    }
+    pending.push_back(id);
+    if (id > measure_after) {
+      result.latency += complete[id] - begin[id];
+      result.frame_time += complete[id] - complete[id - 1];
+      measured++;
+    }
+    if (settled_frame_time != 0 && id > settle_after && result.settled_frame == 0) {
+      settled_streak =
+          manager.GetFrameTime() < settled_frame_time * 1.1 ? settled_streak + 1 : 0;
+      if (settled_streak == 5)
+        result.settled_frame = id - 4 - settle_after;
+    }
+  }
+  result.latency /= measured * kMs;
+  result.frame_time /= measured * kMs;
+  return result;
+}
+
+std::function<uint64_t(uint64_t)> Constant(uint64_t time) {
+  return [=](uint64_t) { return time; };
+}
+
+// Jitter from a fixed pattern, so that runs are reproducible.
+std::function<uint64_t(uint64_t)> Jittered(uint64_t time, uint64_t jitter) {
+  return [=](uint64_t id) {
+    static const int kPattern[] = {0, 3, -2, 1, -4, 2, -1, 4, -3, 0, 2, -2, 3};
+    return time + kPattern[id % std::size(kPattern)] * (int64_t)jitter / 4;
+  };
+}
+
+bool Check(const char *name, bool ok, const Result &result) {
+  std::cout << (ok ? "PASS " : "FAIL ") << name << ": latency=" << result.latency
+            << "ms frame time=" << result.frame_time << "ms";
+  if (result.settled_frame != 0)
+    std::cout << " settled after " << result.settled_frame << " frames";
+  std::cout << std::endl;
+  return ok;
+}
+} // namespace
+
+int main() {
+  bool ok = true;
+
+  // Throttled by vsync at 60 Hz with plenty of headroom: frames should be begun just in time for
+  // their image instead of queuing behind the acquire. Without pacing, the latency is 19.7 ms.
+  Result vsync = Run({Constant(3 * kMs), Constant(3 * kMs), 16666667}, 3000, 1500);
+  ok &= Check("vsync", vsync.latency < 10 && vsync.frame_time < 16.7, vsync);
+  Result vsync_jitter =
+      Run({Jittered(3 * kMs, kMs), Jittered(3 * kMs, kMs), 16666667}, 3000, 1500);
+  // Jitter makes some frames miss their vblank either way.
+  ok &= Check("vsync with jitter", vsync_jitter.latency < 13 && vsync_jitter.frame_time < 18,
+              vsync_jitter);
+
+  Result gpu_bound = Run({Constant(4 * kMs), Constant(10 * kMs)}, 3000, 1500);
+  ok &= Check("GPU-bound", gpu_bound.latency < 16 && gpu_bound.frame_time < 10.5, gpu_bound);
+  Result cpu_bound = Run({Constant(10 * kMs), Constant(4 * kMs)}, 3000, 1500);
+  ok &= Check("CPU-bound", cpu_bound.latency < 16 && cpu_bound.frame_time < 11, cpu_bound);
+
+  // The GPU cost halves at frame 1000: throughput should be recovered within a few dozen frames.
+  Result load_drop =
+      Run({Constant(4 * kMs), [](uint64_t id) { return (id <= 1000 ? 20 : 10) * kMs; }}, 1400,
+          1000, 1000, 10 * kMs);
+  ok &= Check("load drop", load_drop.settled_frame != 0 && load_drop.settled_frame <= 40,
+              load_drop);
+
+  return ok ? 0 : 1;
+}
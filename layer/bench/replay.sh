@@ -0,0 +1,99 @@
+#!/bin/sh
+# Copyright 2022 Tatsuyuki Ishi
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Replay GFXReconstruct captures with the layer enabled and disabled, and report the replay time of
+# each run along with the layer's call overhead, completion thread and recalibration statistics.
+# See docs/PROFILING.md.
+
+set -eu
+
+usage() {
+  echo "Usage: $0 [-n RUNS] [-o DIR] CAPTURE.gfxr..." >&2
+  echo "  -n RUNS  Replays per capture and mode (default: 3)" >&2
+  echo "  -o DIR   Directory for the replay logs (default: a new temporary directory)" >&2
+  echo "Environment:" >&2
+  echo "  GFXRECON_REPLAY       gfxrecon-replay binary (default: gfxrecon-replay)" >&2
+  echo "  LFX_REPLAY_ARGS       Extra replay arguments (default: --wsi headless -m rebind)" >&2
+  echo "  VK_DRIVER_FILES       Driver to replay on, e.g. lavapipe's lvp_icd.x86_64.json" >&2
+  exit 1
+}
+
+runs=3
+logdir=
+while getopts n:o:h opt; do
+  case $opt in
+    n) runs=$OPTARG ;;
+    o) logdir=$OPTARG ;;
+    *) usage ;;
+  esac
+done
+shift $((OPTIND - 1))
+[ $# -gt 0 ] || usage
+
+replay=${GFXRECON_REPLAY:-gfxrecon-replay}
+replay_args=${LFX_REPLAY_ARGS:---wsi headless -m rebind}
+command -v "$replay" >/dev/null || { echo "$replay not found" >&2; exit 1; }
+if [ -z "$logdir" ]; then
+  logdir=$(mktemp -d)
+else
+  mkdir -p "$logdir"
+fi
+
+now_ns() {
+  date +%s%N
+}
+
+# Replay a capture once. $1: capture, $2: mode (enabled or disabled), $3: log file.
+run() {
+  if [ "$2" = enabled ]; then
+    mode_env="LFX=1 LFX_CALL_STATS=1"
+  else
+    mode_env="DISABLE_LFX=1"
+  fi
+  begin=$(now_ns)
+  # shellcheck disable=SC2086 # mode_env and replay_args are lists of arguments
+  if ! env -u LFX -u DISABLE_LFX $mode_env "$replay" $replay_args "$1" >"$3" 2>&1; then
+    echo "  replay failed, see $3" >&2
+    return 1
+  fi
+  end=$(now_ns)
+  echo $(((end - begin) / 1000000))
+}
+
+status=0
+for capture in "$@"; do
+  name=$(basename "$capture" .gfxr)
+  echo "$capture:"
+  for mode in disabled enabled; do
+    i=1
+    while [ "$i" -le "$runs" ]; do
+      log="$logdir/$name.$mode.$i.log"
+      if ms=$(run "$capture" "$mode" "$log"); then
+        echo "  $mode run $i: ${ms}ms"
+      else
+        status=1
+      fi
+      i=$((i + 1))
+    done
+  done
+  # The layer prints its statistics when the device is destroyed.
+  for log in "$logdir/$name".enabled.*.log; do
+    [ -f "$log" ] || continue
+    grep -E "LatencyFleX: (.* overhead over|Completion thread|Recalibrations)" "$log" |
+      sed "s|^|  $(basename "$log" .log): |" || true
+  done
+done
+echo "Logs: $logdir"
+exit $status
@@ -0,0 +1,299 @@
+// Copyright 2022 Tatsuyuki Ishi
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "latencyflex_config.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace lfx {
+namespace config {
+namespace {
+// Values of the config file, with the matching per-executable section already merged over the
+// global one.
+typedef std::multimap<std::string, std::string> Values;
+
+// Settings are read during static initialization of other translation units, so the state is
+// constructed on first use.
+struct State {
+  std::mutex lock;
+  std::shared_ptr<const Values> values;
+  std::map<std::string, std::string> overrides;
+  std::vector<std::function<void()>> callbacks;
+  // The loader unloads the layer with the last instance, so the watcher must not outlive the
+  // module: it is stopped and joined when the state is destroyed.
+  std::thread watcher;
+  int watcher_stop_fd = -1;
+
+  ~State() {
+    if (!watcher.joinable())
+      return;
+    uint64_t one = 1;
+    if (write(watcher_stop_fd, &one, sizeof(one)) == sizeof(one))
+      watcher.join();
+    else
+      watcher.detach();
+    close(watcher_stop_fd);
+  }
+};
+
+State &GetState() {
+  static State state;
+  return state;
+}
+
+std::string ConfigPath() {
+  if (getenv("LFX_CONFIG"))
+    return getenv("LFX_CONFIG");
+  if (getenv("XDG_CONFIG_HOME"))
+    return std::string(getenv("XDG_CONFIG_HOME")) + "/latencyflex.conf";
+  if (getenv("HOME"))
+    return std::string(getenv("HOME")) + "/.config/latencyflex.conf";
+  return "";
+}
+
+std::string BaseName(const std::string &path) {
+  size_t pos = path.find_last_of("/\\");
+  return pos == std::string::npos ? path : path.substr(pos + 1);
+}
+
+std::string Trim(const std::string &str) {
+  size_t begin = str.find_first_not_of(" \t\r");
+  if (begin == std::string::npos)
+    return "";
+  size_t end = str.find_last_not_of(" \t\r");
+  return str.substr(begin, end - begin + 1);
+}
+
+bool EqualsIgnoreCase(const std::string &a, const std::string &b) {
+  return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+           return tolower((unsigned char)x) == tolower((unsigned char)y);
+         });
+}
+
+// Names the current process is known by: the file name of the executable and that of argv[0].
+// Under Wine, the latter is the name of the Windows executable.
+std::vector<std::string> ExecutableNames() {
+  std::vector<std::string> names;
+  char exe[PATH_MAX];
+  ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe));
+  if (len > 0)
+    names.push_back(BaseName(std::string(exe, len)));
+  std::ifstream cmdline("/proc/self/cmdline");
+  std::string argv0;
+  if (std::getline(cmdline, argv0, '\0') && !argv0.empty())
+    names.push_back(BaseName(argv0));
+  return names;
+}
+
+std::shared_ptr<const Values> LoadFile(const std::string &path) {
+  auto result = std::make_shared<Values>();
+  std::ifstream file(path);
+  if (!file)
+    return result;
+
+  static const std::vector<std::string> names = ExecutableNames();
+  Values global, specific;
+  Values *current = &global;
+  std::string line;
+  size_t line_no = 0;
+  while (std::getline(file, line)) {
+    line_no++;
+    size_t comment = line.find('#');
+    if (comment != std::string::npos)
+      line.resize(comment);
+    line = Trim(line);
+    if (line.empty())
+      continue;
+    if (line.front() == '[' && line.back() == ']') {
+      std::string section = Trim(line.substr(1, line.size() - 2));
+      bool matches = std::any_of(names.begin(), names.end(), [&](const std::string &name) {
+        return EqualsIgnoreCase(name, section);
+      });
+      current = section == "*" ? &global : matches ? &specific : nullptr;
+      continue;
+    }
+    size_t eq = line.find('=');
+    if (eq == std::string::npos) {
+      std::cerr << "LatencyFleX: config line " << line_no << " is malformed, ignoring" << std::endl;
+      continue;
+    }
+    if (current)
+      current->emplace(Trim(line.substr(0, eq)), Trim(line.substr(eq + 1)));
+  }
+
+  // A key set in the matching section replaces all of its global values.
+  for (const auto &[key, value] : global) {
+    if (!specific.count(key))
+      result->emplace(key, value);
+  }
+  result->insert(specific.begin(), specific.end());
+  return result;
+}
+
+std::shared_ptr<const Values> GetValues() {
+  State &state = GetState();
+  std::lock_guard<std::mutex> l(state.lock);
+  if (!state.values)
+    state.values = LoadFile(ConfigPath());
+  return state.values;
+}
+
+void WatchThread(std::string path, int stop_fd) {
+  size_t slash = path.find_last_of('/');
+  std::string dir = slash == std::string::npos ? "." : path.substr(0, slash);
+  std::string name = path.substr(slash + 1);
+
+  // Watch the directory rather than the file, so that editors replacing the file by renaming a
+  // new one over it are handled too.
+  int fd = inotify_init1(IN_CLOEXEC);
+  if (fd < 0 || inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE) < 0) {
+    std::cerr << "LatencyFleX: Cannot watch " << dir << " for config changes" << std::endl;
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+
+  alignas(struct inotify_event) char buf[4096];
+  while (true) {
+    struct pollfd fds[2] = {{fd, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (fds[1].revents)
+      break;
+    ssize_t len = read(fd, buf, sizeof(buf));
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0)
+      break;
+    bool changed = false;
+    for (char *ptr = buf; ptr < buf + len;) {
+      auto *event = reinterpret_cast<struct inotify_event *>(ptr);
+      if (event->len && name == event->name)
+        changed = true;
+      ptr += sizeof(struct inotify_event) + event->len;
+    }
+    if (!changed)
+      continue;
+
+    std::shared_ptr<const Values> new_values = LoadFile(path);
+    std::vector<std::function<void()>> callbacks;
+    {
+      State &state = GetState();
+      std::lock_guard<std::mutex> l(state.lock);
+      state.values = new_values;
+      callbacks = state.callbacks;
+    }
+    std::cerr << "LatencyFleX: Reloaded config " << path << std::endl;
+    for (const auto &callback : callbacks)
+      callback();
+  }
+  close(fd);
+}
+} // namespace
+
+std::optional<std::string> Get(const std::string &key) {
+  std::string env = "LFX_" + key;
+  std::transform(env.begin(), env.end(), env.begin(),
+                 [](unsigned char c) { return toupper(c); });
+  if (getenv(env.c_str()))
+    return std::string(getenv(env.c_str()));
+  {
+    State &state = GetState();
+    std::lock_guard<std::mutex> l(state.lock);
+    auto it = state.overrides.find(key);
+    if (it != state.overrides.end())
+      return it->second;
+  }
+  std::shared_ptr<const Values> values_local = GetValues();
+  auto it = values_local->find(key);
+  if (it == values_local->end())
+    return std::nullopt;
+  return it->second;
+}
+
+bool GetBool(const std::string &key, bool default_value) {
+  std::optional<std::string> value = Get(key);
+  if (!value)
+    return default_value;
+  return *value != "0" && !EqualsIgnoreCase(*value, "false") && !EqualsIgnoreCase(*value, "no") &&
+         !EqualsIgnoreCase(*value, "off");
+}
+
+std::optional<double> GetDouble(const std::string &key) {
+  std::optional<std::string> value = Get(key);
+  if (!value)
+    return std::nullopt;
+  char *end;
+  double result = strtod(value->c_str(), &end);
+  if (value->empty() || *end != '\0') {
+    std::cerr << "LatencyFleX: Invalid value for " << key << ": " << *value << std::endl;
+    return std::nullopt;
+  }
+  return result;
+}
+
+std::vector<std::string> GetAll(const std::string &key) {
+  std::shared_ptr<const Values> values_local = GetValues();
+  std::vector<std::string> result;
+  auto range = values_local->equal_range(key);
+  for (auto it = range.first; it != range.second; ++it)
+    result.push_back(it->second);
+  return result;
+}
+
+void SetOverride(const std::string &key, const std::string &value) {
+  State &state = GetState();
+  std::lock_guard<std::mutex> l(state.lock);
+  state.overrides[key] = value;
+}
+
+void Watch(std::function<void()> callback) {
+  // Most processes loading the layer (launchers, tools) have nothing to watch. Don't start a
+  // thread for them.
+  std::string path = ConfigPath();
+  if (path.empty() || access(path.c_str(), F_OK) != 0)
+    return;
+  State &state = GetState();
+  std::lock_guard<std::mutex> l(state.lock);
+  state.callbacks.push_back(std::move(callback));
+  if (!state.watcher.joinable()) {
+    state.watcher_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (state.watcher_stop_fd < 0) {
+      std::cerr << "LatencyFleX: Cannot watch for config changes: " << strerror(errno)
+                << std::endl;
+      return;
+    }
+    state.watcher = std::thread(WatchThread, path, state.watcher_stop_fd);
+  }
+}
+} // namespace config
+} // namespace lfx
@@ -0,0 +1,56 @@
+// Copyright 2022 Tatsuyuki Ishi
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef LATENCYFLEX_LATENCYFLEX_CONFIG_H
+#define LATENCYFLEX_LATENCYFLEX_CONFIG_H
+
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace lfx {
+namespace config {
+// Settings are read from the config file ($XDG_CONFIG_HOME/latencyflex.conf, or the path in
+// LFX_CONFIG) and the environment. A key such as "max_fps" can be overridden with the environment
+// variable of the same name in upper case with an LFX_ prefix, e.g. LFX_MAX_FPS.
+// See docs/latencyflex.conf.example for the file format.
+
+// Look up `key`. Returns std::nullopt if it is set neither in the environment, by the application
+// nor in the file.
+std::optional<std::string> Get(const std::string &key);
+
+// Look up a boolean `key`. "0", "false", "no" and "off" are false; any other value is true.
+// Returns `default_value` if the key is not set.
+bool GetBool(const std::string &key, bool default_value = false);
+
+// Look up a numeric `key`. Malformed values are reported and treated as unset.
+std::optional<double> GetDouble(const std::string &key);
+
+// Get all values of `key`, for keys that can be repeated in the config file. These are not read
+// from the environment.
+std::vector<std::string> GetAll(const std::string &key);
+
+// Set `key` on behalf of the application (e.g. through VK_EXT_layer_settings). Overrides take
+// precedence over the config file, but not over the environment.
+void SetOverride(const std::string &key, const std::string &value);
+
+// Call `callback` from a background thread each time the config file has been changed and
+// reloaded. A reload replaces all values at once, so the callback never observes a partially
+// loaded file. Does nothing if the config file does not exist.
+void Watch(std::function<void()> callback);
+} // namespace config
+} // namespace lfx
+
+#endif // LATENCYFLEX_LATENCYFLEX_CONFIG_H
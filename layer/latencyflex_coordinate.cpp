@@ -0,0 +1,243 @@
+// Copyright 2022 Tatsuyuki Ishi
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "latencyflex_coordinate.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "latencyflex_layer.h"
+
+namespace lfx {
+namespace coordinate {
+namespace {
+// Bumped whenever the layout of the segment changes. Instances of different versions do not
+// coordinate with each other.
+const uint32_t kMagic = 0x4c465801;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "Atomics in shared memory must be lock-free");
+} // namespace
+
+// A slot is written by its owner only. The published values are guarded by a sequence counter,
+// which is odd while they are being written.
+struct Slot {
+  std::atomic<uint32_t> pid;
+  std::atomic<uint32_t> seq;
+  std::atomic<uint64_t> joined;
+  std::atomic<uint64_t> heartbeat;
+  std::atomic<uint64_t> gpu_start;
+  std::atomic<uint64_t> gpu_busy;
+  std::atomic<uint64_t> frame_time;
+};
+
+// All zero in a newly created segment, which is a valid empty state.
+struct Segment {
+  std::atomic<uint32_t> magic;
+  Slot slots[Channel::kMaxInstances];
+};
+
+namespace {
+struct Window {
+  uint64_t start;
+  uint64_t busy;
+  uint64_t frame_time;
+};
+
+// Read the published window of `slot`. Returns false if it is being written.
+bool ReadWindow(const Slot &slot, Window *out) {
+  uint32_t seq = slot.seq.load(std::memory_order_acquire);
+  if (seq % 2 != 0)
+    return false;
+  out->start = slot.gpu_start.load(std::memory_order_relaxed);
+  out->busy = slot.gpu_busy.load(std::memory_order_relaxed);
+  out->frame_time = slot.frame_time.load(std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return slot.seq.load(std::memory_order_relaxed) == seq;
+}
+
+bool IsAlive(const Slot &slot, uint64_t now) {
+  uint32_t pid = slot.pid.load();
+  if (pid == 0)
+    return false;
+  // Not published recently, e.g. in a loading screen, or the process crashed.
+  return now - slot.heartbeat.load() < Channel::kStaleTime;
+}
+} // namespace
+
+bool Channel::Open() {
+  if (segment_)
+    return true;
+  std::string name = "/latencyflex-" + std::to_string(getuid());
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+  if (fd < 0) {
+    std::cerr << "LatencyFleX: Cannot open shared memory " << name << ": " << strerror(errno)
+              << std::endl;
+    return false;
+  }
+  struct stat st;
+  // Another instance might be creating the segment at the same time. Truncating to the same size
+  // is harmless, but never shrink a segment created by a newer version.
+  if (fstat(fd, &st) != 0 ||
+      ((size_t)st.st_size < sizeof(Segment) && ftruncate(fd, sizeof(Segment)) != 0)) {
+    std::cerr << "LatencyFleX: Cannot size shared memory " << name << ": " << strerror(errno)
+              << std::endl;
+    close(fd);
+    return false;
+  }
+  void *addr = mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    std::cerr << "LatencyFleX: Cannot map shared memory " << name << ": " << strerror(errno)
+              << std::endl;
+    return false;
+  }
+  Segment *segment = static_cast<Segment *>(addr);
+
+  uint32_t magic = 0;
+  if (!segment->magic.compare_exchange_strong(magic, kMagic) && magic != kMagic) {
+    std::cerr << "LatencyFleX: Shared memory " << name
+              << " is in use by an incompatible version, not coordinating" << std::endl;
+    munmap(addr, sizeof(Segment));
+    return false;
+  }
+
+  uint32_t self = getpid();
+  uint64_t now = current_time_ns();
+  for (size_t i = 0; i < kMaxInstances; i++) {
+    Slot &slot = segment->slots[i];
+    uint32_t pid = slot.pid.load();
+    // Take over slots of processes that have exited without leaving.
+    if (pid != 0 && (now - slot.heartbeat.load() < kReclaimTime ||
+                     !(kill(pid, 0) != 0 && errno == ESRCH)))
+      continue;
+    if (!slot.pid.compare_exchange_strong(pid, self))
+      continue;
+    slot.gpu_busy.store(0);
+    slot.joined.store(now);
+    slot.heartbeat.store(now);
+    segment_ = segment;
+    slot_ = i;
+    pid_ = self;
+    return true;
+  }
+  std::cerr << "LatencyFleX: All " << kMaxInstances << " coordination slots are taken"
+            << std::endl;
+  munmap(addr, sizeof(Segment));
+  return false;
+}
+
+void Channel::Close() {
+  if (!segment_)
+    return;
+  // Leave the slot alone if it has been taken over in the meantime.
+  uint32_t pid = pid_;
+  segment_->slots[slot_].pid.compare_exchange_strong(pid, 0);
+  munmap(segment_, sizeof(Segment));
+  segment_ = nullptr;
+}
+
+void Channel::Publish(uint64_t gpu_start, uint64_t gpu_busy, uint64_t frame_time) {
+  if (!segment_)
+    return;
+  if (segment_->slots[slot_].pid.load(std::memory_order_relaxed) != pid_) {
+    // Taken over after we have not published for a long time. Join again with a new slot.
+    std::cerr << "LatencyFleX: Lost coordination slot, rejoining" << std::endl;
+    munmap(segment_, sizeof(Segment));
+    segment_ = nullptr;
+    if (!Open())
+      return;
+  }
+  Slot &slot = segment_->slots[slot_];
+  uint32_t seq = slot.seq.load(std::memory_order_relaxed);
+  slot.seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.gpu_start.store(gpu_start, std::memory_order_relaxed);
+  slot.gpu_busy.store(gpu_busy, std::memory_order_relaxed);
+  slot.frame_time.store(frame_time, std::memory_order_relaxed);
+  slot.seq.store(seq + 2, std::memory_order_release);
+  slot.heartbeat.store(current_time_ns(), std::memory_order_relaxed);
+}
+
+int64_t Channel::Interleave(uint64_t gpu_start, uint64_t gpu_busy, uint64_t max_shift) const {
+  if (!segment_ || gpu_busy == 0)
+    return 0;
+  const Slot &self = segment_->slots[slot_];
+  uint64_t joined = self.joined.load();
+  uint64_t now = current_time_ns();
+  int64_t shift = 0;
+  // Moving away from one window can run into another one, so repeat until nothing collides.
+  for (size_t round = 0; round < kMaxInstances; round++) {
+    bool moved = false;
+    for (size_t i = 0; i < kMaxInstances; i++) {
+      const Slot &slot = segment_->slots[i];
+      if (i == slot_ || !IsAlive(slot, now))
+        continue;
+      // Yield to instances that joined earlier only, so that two instances never move away from
+      // each other at the same time.
+      uint64_t peer_joined = slot.joined.load();
+      if (peer_joined > joined || (peer_joined == joined && i > slot_))
+        continue;
+      Window peer;
+      // A GPU that is busy with the peer all the time leaves no gap to fit in.
+      if (!ReadWindow(slot, &peer) || peer.busy == 0 || peer.busy >= peer.frame_time)
+        continue;
+      uint64_t start = gpu_start + shift;
+      uint64_t end = start + gpu_busy;
+      // The peer repeats its window every frame: find the last one starting before our end.
+      if (peer.start < end)
+        peer.start += (end - 1 - peer.start) / peer.frame_time * peer.frame_time;
+      else
+        peer.start -= ((peer.start - end) / peer.frame_time + 1) * peer.frame_time;
+      if (peer.start + peer.busy <= start)
+        continue;
+      int64_t after = (int64_t)(peer.start + peer.busy - start);
+      int64_t before = -(int64_t)(end - peer.start);
+      int64_t step = after <= -before ? after : before;
+      if (std::abs(shift + step) > (int64_t)max_shift)
+        step = step == after ? before : after;
+      if (std::abs(shift + step) > (int64_t)max_shift)
+        continue;
+      shift += step;
+      moved = true;
+    }
+    if (!moved)
+      break;
+  }
+  return shift;
+}
+
+size_t Channel::GetPeerCount() const {
+  if (!segment_)
+    return 0;
+  uint64_t now = current_time_ns();
+  size_t count = 0;
+  for (size_t i = 0; i < kMaxInstances; i++) {
+    if (i != slot_ && IsAlive(segment_->slots[i], now))
+      count++;
+  }
+  return count;
+}
+} // namespace coordinate
+} // namespace lfx
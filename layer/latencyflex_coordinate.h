@@ -0,0 +1,74 @@
+// Copyright 2022 Tatsuyuki Ishi
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef LATENCYFLEX_LATENCYFLEX_COORDINATE_H
+#define LATENCYFLEX_LATENCYFLEX_COORDINATE_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace lfx {
+namespace coordinate {
+struct Segment;
+
+// Coordination between instances of LatencyFleX pacing processes that share a GPU, such as
+// several game clients on one machine. Without it, each controller reads the GPU work of the
+// others as queuing of its own, and backs off.
+//
+// Instances of the same user join a shared memory segment, and publish the time window in which
+// the GPU work of their next frame is expected to run, together with their frame time. Instances
+// yield to the ones that joined before them: the wake-up target is moved so that the GPU work of
+// the frame falls before or after those windows, whichever is closer, instead of colliding with
+// them. Instances that have not published for `kStaleTime` are ignored.
+//
+// Times are in the clock domain of current_time_ns(), which is shared between processes.
+class Channel {
+public:
+  static const size_t kMaxInstances = 8;
+  static const uint64_t kStaleTime = 1000000000;
+  // A slot is only taken over from a process that looks dead if it has not published for this
+  // long. Processes in other PID namespaces (e.g. Steam Runtime containers) sharing /dev/shm look
+  // dead even while running.
+  static const uint64_t kReclaimTime = 30 * kStaleTime;
+
+  ~Channel() { Close(); }
+
+  // Join the channel. Returns false if the shared memory segment cannot be used, or if all slots
+  // are taken.
+  bool Open();
+  void Close();
+  bool is_open() const { return segment_ != nullptr; }
+
+  // Publish that the GPU work of our next frame is expected in [`gpu_start`, `gpu_start` +
+  // `gpu_busy`), and that a frame is begun every `frame_time`.
+  void Publish(uint64_t gpu_start, uint64_t gpu_busy, uint64_t frame_time);
+
+  // Get the shift to apply to our wake-up target, so that our GPU work expected in [`gpu_start`,
+  // `gpu_start` + `gpu_busy`) does not overlap with the work of instances with priority over us.
+  // The shift is limited to `max_shift` in either direction; a collision that cannot be avoided
+  // within that is left as is.
+  int64_t Interleave(uint64_t gpu_start, uint64_t gpu_busy, uint64_t max_shift) const;
+
+  // Get the number of other instances that have published recently.
+  size_t GetPeerCount() const;
+
+private:
+  Segment *segment_ = nullptr;
+  size_t slot_ = 0;
+  uint32_t pid_ = 0;
+};
+} // namespace coordinate
+} // namespace lfx
+
+#endif // LATENCYFLEX_LATENCYFLEX_COORDINATE_H
@@ -0,0 +1,305 @@
+// Copyright 2022 Tatsuyuki Ishi
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// OpenGL support, loaded with LD_PRELOAD. Intercepts glXSwapBuffers and eglSwapBuffers, and
+// measures the completion of each frame with a fence waited on by a dedicated thread:
+// - For EGL, an EGL fence sync, which can be waited on from any thread.
+// - For GLX, a GL fence sync, waited on from a context sharing objects with the application's.
+
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#include <dlfcn.h>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GL/glx.h>
+
+#include "latencyflex_layer.h"
+
+namespace {
+typedef void (*PFN_glXSwapBuffers)(Display *, GLXDrawable);
+typedef __GLXextFuncPtr (*PFN_glXGetProcAddress)(const GLubyte *);
+typedef EGLBoolean (*PFN_eglSwapBuffers)(EGLDisplay, EGLSurface);
+typedef __eglMustCastToProperFunctionPointerType (*PFN_eglGetProcAddress)(const char *);
+
+PFN_glXSwapBuffers real_glXSwapBuffers;
+PFN_glXGetProcAddress real_glXGetProcAddress;
+PFN_glXGetProcAddress real_glXGetProcAddressARB;
+PFN_eglSwapBuffers real_eglSwapBuffers;
+PFN_eglGetProcAddress real_eglGetProcAddress;
+
+// EGL_KHR_fence_sync entry points, loaded on the first EGL swap.
+PFNEGLCREATESYNCKHRPROC egl_CreateSyncKHR;
+PFNEGLCLIENTWAITSYNCKHRPROC egl_ClientWaitSyncKHR;
+PFNEGLDESTROYSYNCKHRPROC egl_DestroySyncKHR;
+
+// Use the swap as the frame boundary and call lfx_WaitAndBeginFrame after it returns. Only suitable
+// for applications that do all their work on a single thread, in the order of input, simulation,
+// rendering and swap. Leave this off if another tick source (e.g. the SDL2/GLFW hook) is in use.
+bool tick_on_swap = false;
+
+struct PendingFrame {
+  uint64_t frame_id;
+  // Exactly one of the two is set.
+  GLsync gl_sync;
+  EGLDisplay egl_display;
+  EGLSyncKHR egl_sync;
+};
+
+class SyncWaitThread {
+public:
+  SyncWaitThread() : thread_(&SyncWaitThread::Worker, this) {}
+
+  ~SyncWaitThread() {
+    {
+      std::unique_lock<std::mutex> l(local_lock_);
+      running_ = false;
+    }
+    notify_.notify_all();
+    thread_.join();
+  }
+
+  // Set up the context used to wait on GL fences. Must be called on a thread where a context
+  // sharing objects with `share_context` is current, before any GL fence is pushed.
+  bool InitGlx(Display *display, GLXContext share_context);
+
+  bool HasGlxContext(GLXContext share_context) const {
+    return !glx_failed_ && share_context_ == share_context;
+  }
+
+  void Push(PendingFrame &&frame) {
+    std::unique_lock<std::mutex> l(local_lock_);
+    queue_.push_back(frame);
+    notify_.notify_all();
+  }
+
+private:
+  void Worker();
+
+  std::thread thread_;
+  std::mutex local_lock_;
+  std::condition_variable notify_;
+  std::deque<PendingFrame> queue_;
+  bool running_ = true;
+
+  Display *display_ = nullptr;
+  GLXContext share_context_ = nullptr;
+  GLXContext context_ = nullptr;
+  GLXPbuffer pbuffer_ = 0;
+  bool context_current_ = false;
+  // Set if the context could not be made current, after which GL fences are no longer accepted.
+  std::atomic<bool> glx_failed_ = false;
+
+  PFNGLCLIENTWAITSYNCPROC glClientWaitSync_ = nullptr;
+  PFNGLDELETESYNCPROC glDeleteSync_ = nullptr;
+};
+
+bool SyncWaitThread::InitGlx(Display *display, GLXContext share_context) {
+  int fbconfig_id, screen;
+  if (glXQueryContext(display, share_context, GLX_FBCONFIG_ID, &fbconfig_id) != Success ||
+      glXQueryContext(display, share_context, GLX_SCREEN, &screen) != Success)
+    return false;
+  const int config_attribs[] = {GLX_FBCONFIG_ID, fbconfig_id, None};
+  int num_configs = 0;
+  GLXFBConfig *configs = glXChooseFBConfig(display, screen, config_attribs, &num_configs);
+  if (!configs || num_configs == 0)
+    return false;
+  GLXContext context = glXCreateNewContext(display, configs[0], GLX_RGBA_TYPE, share_context,
+                                           glXIsDirect(display, share_context));
+  const int pbuffer_attribs[] = {GLX_PBUFFER_WIDTH, 1, GLX_PBUFFER_HEIGHT, 1, None};
+  GLXPbuffer pbuffer = context ? glXCreatePbuffer(display, configs[0], pbuffer_attribs) : 0;
+  XFree(configs);
+  if (!pbuffer) {
+    if (context)
+      glXDestroyContext(display, context);
+    return false;
+  }
+
+  std::unique_lock<std::mutex> l(local_lock_);
+  display_ = display;
+  share_context_ = share_context;
+  context_ = context;
+  pbuffer_ = pbuffer;
+  glClientWaitSync_ = (PFNGLCLIENTWAITSYNCPROC)real_glXGetProcAddressARB(
+      (const GLubyte *)"glClientWaitSync");
+  glDeleteSync_ = (PFNGLDELETESYNCPROC)real_glXGetProcAddressARB((const GLubyte *)"glDeleteSync");
+  return glClientWaitSync_ && glDeleteSync_;
+}
+
+void SyncWaitThread::Worker() {
+  while (true) {
+    PendingFrame frame;
+    {
+      std::unique_lock<std::mutex> l(local_lock_);
+      while (queue_.empty()) {
+        if (!running_) {
+          if (context_current_)
+            glXMakeContextCurrent(display_, None, None, nullptr);
+          return;
+        }
+        notify_.wait(l);
+      }
+      frame = queue_.front();
+      queue_.pop_front();
+    }
+
+    uint64_t complete;
+    if (frame.egl_sync) {
+      egl_ClientWaitSyncKHR(frame.egl_display, frame.egl_sync, 0, EGL_FOREVER_KHR);
+      complete = current_time_ns();
+      egl_DestroySyncKHR(frame.egl_display, frame.egl_sync);
+    } else {
+      if (!context_current_) {
+        // The application has already flushed the fence through the swap, so it is safe to wait
+        // on it from another context in the share group.
+        context_current_ = glXMakeContextCurrent(display_, pbuffer_, pbuffer_, context_);
+        if (!context_current_) {
+          // The fence can then neither be waited on nor deleted. Complete the frame now so that
+          // it is not lost, and stop tracking further GL frames.
+          std::cerr << "LatencyFleX: Cannot make the fence wait context current" << std::endl;
+          glx_failed_ = true;
+          lfx_EndFrame(frame.frame_id, 0);
+          continue;
+        }
+      }
+      glClientWaitSync_(frame.gl_sync, 0, UINT64_MAX);
+      complete = current_time_ns();
+      glDeleteSync_(frame.gl_sync);
+    }
+    lfx_EndFrame(frame.frame_id, complete);
+  }
+}
+
+std::mutex wait_thread_lock;
+SyncWaitThread *wait_thread;
+
+SyncWaitThread &GetWaitThread() {
+  std::unique_lock<std::mutex> l(wait_thread_lock);
+  if (!wait_thread)
+    wait_thread = new SyncWaitThread();
+  return *wait_thread;
+}
+
+// Swaps whose completion cannot be tracked are not counted as presents, so that every frame
+// begun with lfx_BeginPresent is also ended.
+void OnGlxSwap(Display *display) {
+  GLXContext context = glXGetCurrentContext();
+  if (!context)
+    return;
+
+  SyncWaitThread &thread = GetWaitThread();
+  static GLXContext failed_context = nullptr;
+  if (!thread.HasGlxContext(context)) {
+    // Only a single share group can be tracked. Applications rarely swap from more than one.
+    static bool initialized = false;
+    if (initialized || context == failed_context)
+      return;
+    if (!thread.InitGlx(display, context)) {
+      std::cerr << "LatencyFleX: Cannot create a shared context for fence waits" << std::endl;
+      failed_context = context;
+      return;
+    }
+    initialized = true;
+  }
+
+  static PFNGLFENCESYNCPROC glFenceSync_ =
+      (PFNGLFENCESYNCPROC)real_glXGetProcAddressARB((const GLubyte *)"glFenceSync");
+  GLsync sync = glFenceSync_(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  if (sync)
+    thread.Push({lfx_BeginPresent(), sync, EGL_NO_DISPLAY, EGL_NO_SYNC_KHR});
+}
+
+void OnEglSwap(EGLDisplay display) {
+  static bool loaded = [] {
+    egl_CreateSyncKHR = (PFNEGLCREATESYNCKHRPROC)real_eglGetProcAddress("eglCreateSyncKHR");
+    egl_ClientWaitSyncKHR =
+        (PFNEGLCLIENTWAITSYNCKHRPROC)real_eglGetProcAddress("eglClientWaitSyncKHR");
+    egl_DestroySyncKHR = (PFNEGLDESTROYSYNCKHRPROC)real_eglGetProcAddress("eglDestroySyncKHR");
+    return egl_CreateSyncKHR && egl_ClientWaitSyncKHR && egl_DestroySyncKHR;
+  }();
+  if (!loaded)
+    return;
+  // Requires EGL_KHR_fence_sync. The fence is inserted into the current context.
+  EGLSyncKHR sync = egl_CreateSyncKHR(display, EGL_SYNC_FENCE_KHR, nullptr);
+  if (sync != EGL_NO_SYNC_KHR)
+    GetWaitThread().Push({lfx_BeginPresent(), nullptr, display, sync});
+}
+
+template <typename T> void LoadReal(T *func, const char *name) {
+  if (!*func)
+    *func = reinterpret_cast<T>(dlsym(RTLD_NEXT, name));
+}
+
+class OnLoad {
+public:
+  OnLoad() {
+    std::cerr << "LatencyFleX: OpenGL module loaded" << std::endl;
+    if (lfx_GetConfigBool("gl_swap_tick")) {
+      tick_on_swap = true;
+      std::cerr << "LatencyFleX: Using buffer swaps as tick boundaries" << std::endl;
+    }
+  }
+};
+
+[[maybe_unused]] OnLoad on_load;
+} // namespace
+
+extern "C" VK_LAYER_EXPORT void glXSwapBuffers(Display *dpy, GLXDrawable drawable) {
+  LoadReal(&real_glXSwapBuffers, "glXSwapBuffers");
+  LoadReal(&real_glXGetProcAddressARB, "glXGetProcAddressARB");
+  OnGlxSwap(dpy);
+  real_glXSwapBuffers(dpy, drawable);
+  if (tick_on_swap)
+    lfx_WaitAndBeginFrame();
+}
+
+extern "C" VK_LAYER_EXPORT EGLBoolean eglSwapBuffers(EGLDisplay dpy, EGLSurface surface) {
+  LoadReal(&real_eglSwapBuffers, "eglSwapBuffers");
+  LoadReal(&real_eglGetProcAddress, "eglGetProcAddress");
+  OnEglSwap(dpy);
+  EGLBoolean ret = real_eglSwapBuffers(dpy, surface);
+  if (tick_on_swap)
+    lfx_WaitAndBeginFrame();
+  return ret;
+}
+
+// Applications loading the swap functions dynamically would otherwise bypass the interposition.
+
+extern "C" VK_LAYER_EXPORT __GLXextFuncPtr glXGetProcAddressARB(const GLubyte *name) {
+  LoadReal(&real_glXGetProcAddressARB, "glXGetProcAddressARB");
+  if (!strcmp((const char *)name, "glXSwapBuffers"))
+    return (__GLXextFuncPtr)&glXSwapBuffers;
+  return real_glXGetProcAddressARB(name);
+}
+
+extern "C" VK_LAYER_EXPORT __GLXextFuncPtr glXGetProcAddress(const GLubyte *name) {
+  LoadReal(&real_glXGetProcAddress, "glXGetProcAddress");
+  if (!strcmp((const char *)name, "glXSwapBuffers"))
+    return (__GLXextFuncPtr)&glXSwapBuffers;
+  return real_glXGetProcAddress(name);
+}
+
+extern "C" VK_LAYER_EXPORT __eglMustCastToProperFunctionPointerType
+eglGetProcAddress(const char *name) {
+  LoadReal(&real_eglGetProcAddress, "eglGetProcAddress");
+  if (!strcmp(name, "eglSwapBuffers"))
+    return (__eglMustCastToProperFunctionPointerType)&eglSwapBuffers;
+  return real_eglGetProcAddress(name);
+}
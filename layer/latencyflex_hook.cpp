@@ -0,0 +1,432 @@
+// Copyright 2021 Tatsuyuki Ishi
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <array>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+#include <dlfcn.h>
+#include <funchook.h>
+#include <link.h>
+
+#include "latencyflex_config.h"
+#include "latencyflex_layer.h"
+#include "latencyflex_sigscan.h"
+
+namespace {
+enum class HookAction {
+  kWaitAndBeginFrame,
+  kInputSample,
+  kSimulationEnd,
+  kRenderSubmit,
+  kRenderBegin,
+  kRenderEnd,
+};
+
+enum class TargetKind {
+  // Offset relative to the load address of the module (equal to the absolute address for
+  // executables built without PIE).
+  kOffset,
+  // Exported (dynamic) symbol name, mangled.
+  kSymbol,
+  // Byte pattern, see lfx::sigscan::Pattern.
+  kPattern,
+  // Function name to look up in the signature database.
+  kDatabase,
+};
+
+struct HookSpec {
+  // File name of the module, or empty for the main executable.
+  std::string module;
+  HookAction action;
+  TargetKind kind;
+  std::string target;
+};
+
+const size_t kMaxHooks = 16;
+
+HookAction hook_actions[kMaxHooks];
+funchook_t *hook_handle;
+
+void RunAction(HookAction action) {
+  switch (action) {
+  case HookAction::kWaitAndBeginFrame:
+    lfx_WaitAndBeginFrame();
+    break;
+  case HookAction::kInputSample:
+    lfx_MarkStage(LFX_STAGE_INPUT_SAMPLE);
+    break;
+  case HookAction::kSimulationEnd:
+    lfx_MarkStage(LFX_STAGE_SIMULATION_END);
+    break;
+  case HookAction::kRenderSubmit:
+    lfx_MarkStage(LFX_STAGE_RENDER_SUBMIT);
+    break;
+  case HookAction::kRenderBegin:
+    lfx_MarkStage(LFX_STAGE_RENDER_BEGIN);
+    break;
+  case HookAction::kRenderEnd:
+    lfx_MarkStage(LFX_STAGE_RENDER_END);
+    break;
+  }
+}
+} // namespace
+
+// Original functions of the hooked slots, as trampolines filled in by funchook.
+extern "C" __attribute__((visibility("hidden"))) void *lfx_hook_real[kMaxHooks];
+void *lfx_hook_real[kMaxHooks];
+
+extern "C" __attribute__((visibility("hidden"))) void lfx_hook_run_action(size_t slot) {
+  RunAction(hook_actions[slot]);
+}
+
+#if defined(__x86_64__)
+// Each slot is entered through a stub that saves every register that can carry an argument
+// (including the vector registers used for floating point arguments, and %al for variadic
+// functions), runs the action, restores them and jumps to the original function. The stack is left
+// as the caller set it up, so functions of any signature can be hooked.
+extern "C" __attribute__((visibility("hidden"))) void *const lfx_hook_stubs[kMaxHooks];
+static_assert(kMaxHooks == 16, "the stubs below are generated for 16 slots");
+
+asm(R"(
+  .pushsection .text
+  .irp i,0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15
+  .p2align 4
+  .type lfx_hook_stub_\i, @function
+lfx_hook_stub_\i:
+  .cfi_startproc
+  push %rbp
+  .cfi_def_cfa_offset 16
+  .cfi_offset %rbp, -16
+  mov %rsp, %rbp
+  .cfi_def_cfa_register %rbp
+  push %rdi
+  push %rsi
+  push %rdx
+  push %rcx
+  push %r8
+  push %r9
+  push %rax
+  push %r10
+  sub $128, %rsp
+  movdqu %xmm0, 0(%rsp)
+  movdqu %xmm1, 16(%rsp)
+  movdqu %xmm2, 32(%rsp)
+  movdqu %xmm3, 48(%rsp)
+  movdqu %xmm4, 64(%rsp)
+  movdqu %xmm5, 80(%rsp)
+  movdqu %xmm6, 96(%rsp)
+  movdqu %xmm7, 112(%rsp)
+  mov $\i, %edi
+  call lfx_hook_run_action
+  movdqu 0(%rsp), %xmm0
+  movdqu 16(%rsp), %xmm1
+  movdqu 32(%rsp), %xmm2
+  movdqu 48(%rsp), %xmm3
+  movdqu 64(%rsp), %xmm4
+  movdqu 80(%rsp), %xmm5
+  movdqu 96(%rsp), %xmm6
+  movdqu 112(%rsp), %xmm7
+  add $128, %rsp
+  pop %r10
+  pop %rax
+  pop %r9
+  pop %r8
+  pop %rcx
+  pop %rdx
+  pop %rsi
+  pop %rdi
+  pop %rbp
+  .cfi_def_cfa %rsp, 8
+  jmp *lfx_hook_real+8*\i(%rip)
+  .cfi_endproc
+  .size lfx_hook_stub_\i, .-lfx_hook_stub_\i
+  .endr
+  .popsection
+
+  .pushsection .data.rel.ro, "aw"
+  .p2align 3
+  .globl lfx_hook_stubs
+  .hidden lfx_hook_stubs
+  .type lfx_hook_stubs, @object
+lfx_hook_stubs:
+  .irp i,0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15
+  .quad lfx_hook_stub_\i
+  .endr
+  .size lfx_hook_stubs, .-lfx_hook_stubs
+  .popsection
+)");
+
+namespace {
+void *HookEntry(size_t slot) { return lfx_hook_stubs[slot]; }
+} // namespace
+#else
+namespace {
+// Elsewhere, hooks can only be placed on functions taking up to six integer or pointer arguments
+// and returning void or an integer/pointer. Arguments passed in vector registers or on the stack
+// are not forwarded. This covers the usual engine entry points, which are member functions without
+// arguments like FEngineLoop::Tick.
+typedef uintptr_t (*hook_func)(uintptr_t, uintptr_t, uintptr_t, uintptr_t, uintptr_t, uintptr_t);
+
+template <size_t I>
+uintptr_t Detour(uintptr_t a0, uintptr_t a1, uintptr_t a2, uintptr_t a3, uintptr_t a4,
+                 uintptr_t a5) {
+  lfx_hook_run_action(I);
+  return reinterpret_cast<hook_func>(lfx_hook_real[I])(a0, a1, a2, a3, a4, a5);
+}
+
+template <size_t... I>
+constexpr std::array<hook_func, sizeof...(I)> MakeDetours(std::index_sequence<I...>) {
+  return {&Detour<I>...};
+}
+
+const std::array<hook_func, kMaxHooks> detours = MakeDetours(std::make_index_sequence<kMaxHooks>());
+
+void *HookEntry(size_t slot) { return (void *)detours[slot]; }
+} // namespace
+#endif
+
+namespace {
+bool ParseAction(const std::string &name, HookAction *action) {
+  if (name == "wait-and-begin")
+    *action = HookAction::kWaitAndBeginFrame;
+  else if (name == "input-sample")
+    *action = HookAction::kInputSample;
+  else if (name == "sim-end")
+    *action = HookAction::kSimulationEnd;
+  else if (name == "render-submit")
+    *action = HookAction::kRenderSubmit;
+  else if (name == "render-begin")
+    *action = HookAction::kRenderBegin;
+  else if (name == "render-end")
+    *action = HookAction::kRenderEnd;
+  else
+    return false;
+  return true;
+}
+
+// Parse a hexadecimal offset, with or without 0x.
+bool ParseOffset(const std::string &text, uintptr_t *offset) {
+  char *end;
+  errno = 0;
+  *offset = strtoull(text.c_str(), &end, 16);
+  return !text.empty() && isxdigit((unsigned char)text[0]) && *end == '\0' && errno != ERANGE;
+}
+
+// Parse a line of the form "<module> <action> <target>". See docs/hooks.conf for the syntax.
+bool ParseHookSpec(const std::string &line, HookSpec *spec) {
+  std::istringstream is(line);
+  std::string action, target;
+  if (!(is >> spec->module >> action) || !std::getline(is >> std::ws, target))
+    return false;
+  if (spec->module == "main")
+    spec->module.clear();
+  if (!ParseAction(action, &spec->action))
+    return false;
+  if (target.rfind("0x", 0) == 0) {
+    uintptr_t offset;
+    if (!ParseOffset(target, &offset))
+      return false;
+    spec->kind = TargetKind::kOffset;
+    spec->target = target;
+  } else if (target.rfind("sym:", 0) == 0) {
+    spec->kind = TargetKind::kSymbol;
+    spec->target = target.substr(4);
+  } else if (target.rfind("sig:", 0) == 0) {
+    spec->kind = TargetKind::kPattern;
+    spec->target = target.substr(4);
+  } else if (target.rfind("db:", 0) == 0) {
+    spec->kind = TargetKind::kDatabase;
+    spec->target = target.substr(3);
+  } else {
+    return false;
+  }
+  return !spec->target.empty();
+}
+
+int FindModuleBase(struct dl_phdr_info *info, size_t, void *data) {
+  auto *target = static_cast<std::pair<const std::string *, uintptr_t *> *>(data);
+  const std::string &module = *target->first;
+  bool is_main = info->dlpi_name == nullptr || info->dlpi_name[0] == '\0';
+  if (module.empty() ? !is_main : strstr(info->dlpi_name, module.c_str()) == nullptr)
+    return 0;
+  *target->second = info->dlpi_addr;
+  return 1;
+}
+
+uintptr_t Resolve(const HookSpec &spec) {
+  switch (spec.kind) {
+  case TargetKind::kOffset: {
+    uintptr_t base = UINTPTR_MAX;
+    std::pair<const std::string *, uintptr_t *> data{&spec.module, &base};
+    dl_iterate_phdr(FindModuleBase, &data);
+    uintptr_t offset;
+    if (base == UINTPTR_MAX || !ParseOffset(spec.target, &offset))
+      return 0;
+    return base + offset;
+  }
+  case TargetKind::kSymbol: {
+    void *handle = spec.module.empty() ? dlopen(nullptr, RTLD_NOW)
+                                       : dlopen(spec.module.c_str(), RTLD_NOW | RTLD_NOLOAD);
+    if (!handle)
+      return 0;
+    // The module stays loaded after the handle is closed, as it was loaded before.
+    uintptr_t address = (uintptr_t)dlsym(handle, spec.target.c_str());
+    dlclose(handle);
+    return address;
+  }
+  case TargetKind::kPattern: {
+    lfx::sigscan::Pattern pattern;
+    if (!lfx::sigscan::ParsePattern(spec.target, &pattern))
+      return 0;
+    return lfx::sigscan::ScanModule(spec.module, pattern);
+  }
+  case TargetKind::kDatabase:
+    return lfx::sigscan::FindFunction(spec.module, spec.target);
+  }
+  return 0;
+}
+
+// Built-in hooks for UE4/UE5, enabled through config keys (or the corresponding LFX_UE4_*
+// environment variables) taking either an offset or "scan" to look up the function in the signature
+// database.
+struct UnrealHook {
+  const char *key;
+  HookAction action;
+  const char *function;
+};
+
+const UnrealHook kUnrealHooks[] = {
+    // Game thread: start of the frame.
+    {"ue4_hook", HookAction::kWaitAndBeginFrame, "FEngineLoop::Tick"},
+    // Rendering thread: enqueued by FEngineLoop::Tick around the rendering commands of a frame.
+    {"ue4_render_begin_hook", HookAction::kRenderBegin, "BeginFrameRenderThread"},
+    {"ue4_render_end_hook", HookAction::kRenderEnd, "EndFrameRenderThread"},
+    // RHI thread (or rendering thread without a separate RHI thread): submission and present.
+    {"ue4_rhi_submit_hook", HookAction::kRenderSubmit,
+     "FVulkanDynamicRHI::RHIEndDrawingViewport"},
+};
+
+// Hooks are read once at load time. Changes to the config file take effect on the next launch.
+std::vector<HookSpec> LoadHookSpecs() {
+  std::vector<HookSpec> specs;
+  for (const UnrealHook &hook : kUnrealHooks) {
+    std::optional<std::string> value = lfx::config::Get(hook.key);
+    if (!value)
+      continue;
+    uintptr_t offset;
+    if (value != "scan" && !ParseOffset(*value, &offset)) {
+      std::cerr << "LatencyFleX: " << hook.key << " \"" << *value
+                << "\" is not a valid offset, ignoring" << std::endl;
+      continue;
+    }
+    // Equivalent to "main <action> <offset>" or "main <action> db:<function>".
+    specs.push_back({"", hook.action, value == "scan" ? TargetKind::kDatabase : TargetKind::kOffset,
+                     value == "scan" ? hook.function : *value});
+  }
+  // Hooks listed directly in the config file, as "hook = <module> <action> <target>".
+  for (const std::string &line : lfx::config::GetAll("hook")) {
+    HookSpec spec;
+    if (!ParseHookSpec(line, &spec)) {
+      std::cerr << "LatencyFleX: hook \"" << line << "\" is malformed, ignoring" << std::endl;
+      continue;
+    }
+    specs.push_back(std::move(spec));
+  }
+  if (std::optional<std::string> path = lfx::config::Get("hook_config")) {
+    std::ifstream file(*path);
+    if (!file) {
+      std::cerr << "LatencyFleX: Cannot open hook config " << *path << std::endl;
+    }
+    std::string line;
+    size_t line_no = 0;
+    while (std::getline(file, line)) {
+      line_no++;
+      size_t comment = line.find('#');
+      if (comment != std::string::npos)
+        line.resize(comment);
+      if (line.find_first_not_of(" \t") == std::string::npos)
+        continue;
+      HookSpec spec;
+      if (!ParseHookSpec(line, &spec)) {
+        std::cerr << "LatencyFleX: hook config line " << line_no << " is malformed, ignoring"
+                  << std::endl;
+        continue;
+      }
+      specs.push_back(std::move(spec));
+    }
+  }
+  return specs;
+}
+
+void hook_init() {
+  std::vector<HookSpec> specs = LoadHookSpecs();
+  if (specs.empty())
+    return;
+  if (specs.size() > kMaxHooks) {
+    std::cerr << "LatencyFleX: Too many hooks, only the first " << kMaxHooks << " are installed"
+              << std::endl;
+    specs.resize(kMaxHooks);
+  }
+
+  // Hooks that cannot be resolved or prepared are skipped, so that e.g. a missing render stage hook
+  // does not take the frame begin hook down with it. The rest are installed in one transaction.
+  int err = 0;
+  size_t count = 0;
+  hook_handle = funchook_create();
+  for (const HookSpec &spec : specs) {
+    uintptr_t address = Resolve(spec);
+    if (!address) {
+      std::cerr << "LatencyFleX: Cannot resolve hook target " << spec.target << ", skipping"
+                << std::endl;
+      continue;
+    }
+    hook_actions[count] = spec.action;
+    lfx_hook_real[count] = (void *)address;
+    err = funchook_prepare(hook_handle, &lfx_hook_real[count], HookEntry(count));
+    if (err != 0) {
+      std::cerr << "LatencyFleX: Cannot hook " << spec.target << ", err=" << err << " ("
+                << funchook_error_message(hook_handle) << "), skipping" << std::endl;
+      continue;
+    }
+    count++;
+  }
+  if (count == 0) {
+    funchook_destroy(hook_handle);
+    return;
+  }
+  err = funchook_install(hook_handle, 0);
+  if (err != 0) {
+    std::cerr << "LatencyFleX: Error during hook initialization, err=" << err << " ("
+              << funchook_error_message(hook_handle) << ")" << std::endl;
+    funchook_destroy(hook_handle);
+    return;
+  }
+  std::cerr << "LatencyFleX: Successfully installed " << count << " hook(s)" << std::endl;
+}
+
+class OnLoad {
+public:
+  OnLoad() { hook_init(); }
+};
+
+[[maybe_unused]] OnLoad on_load;
+} // namespace
@@ -0,0 +1,119 @@
+// Copyright 2022 Tatsuyuki Ishi
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tick source for games built on SDL2 or GLFW, loaded with LD_PRELOAD as part of the preload
+// module. The event poll is where input is sampled, so the first poll of each frame is used as the
+// frame boundary: a poll after the events have been fully polled starts a new frame.
+
+#include <atomic>
+#include <iostream>
+
+#include <dlfcn.h>
+
+#include "latencyflex_layer.h"
+
+union SDL_Event;
+
+namespace {
+typedef int (*PFN_SDL_PollEvent)(SDL_Event *);
+typedef void (*PFN_SDL_PumpEvents)();
+typedef void (*PFN_glfwPollEvents)();
+
+PFN_SDL_PollEvent real_SDL_PollEvent;
+PFN_SDL_PumpEvents real_SDL_PumpEvents;
+PFN_glfwPollEvents real_glfwPollEvents;
+
+bool tick_on_poll = false;
+
+// Whether the events of the current frame have been fully polled: SDL_PollEvent returned 0, or
+// SDL_PumpEvents/glfwPollEvents returned. The next poll starts a new frame.
+std::atomic_bool frame_polled = true;
+
+// The boundaries are cross-checked against presents. A game with a rendering thread presents each
+// frame after the next one has started polling, so ticks and presents don't strictly alternate,
+// but they keep pace over a window of ticks. A game polling more than once per frame (e.g. from a
+// separate UI loop) ticks about twice per present; once that is seen, only the first poll after a
+// present starts a new frame. Only accessed from the polling thread.
+const uint64_t kCheckTicks = 64;
+uint64_t window_ticks = 0;
+uint64_t window_presents = 0;
+uint64_t last_tick_present = UINT64_MAX;
+bool present_gated = false;
+
+void OnPoll() {
+  if (!tick_on_poll || !frame_polled.load())
+    return;
+  uint64_t present_count = lfx_GetPresentCount();
+  if (present_gated && present_count == last_tick_present)
+    return;
+  frame_polled.store(false);
+  // The present count is reset on recalibration.
+  if (present_count < window_presents) {
+    window_ticks = 0;
+    window_presents = present_count;
+  }
+  if (++window_ticks == kCheckTicks) {
+    if (!present_gated && present_count - window_presents < kCheckTicks * 3 / 4) {
+      present_gated = true;
+      std::cerr << "LatencyFleX: Events polled more than once per frame, using the first poll "
+                   "after each present"
+                << std::endl;
+    }
+    window_ticks = 0;
+    window_presents = present_count;
+  }
+  last_tick_present = present_count;
+  lfx_WaitAndBeginFrame();
+}
+
+template <typename T> void LoadReal(T *func, const char *name) {
+  if (!*func)
+    *func = reinterpret_cast<T>(dlsym(RTLD_NEXT, name));
+}
+
+class OnLoad {
+public:
+  OnLoad() {
+    if (lfx_GetConfigBool("poll_tick")) {
+      tick_on_poll = true;
+      std::cerr << "LatencyFleX: Using SDL2/GLFW event polls as tick boundaries" << std::endl;
+    }
+  }
+};
+
+[[maybe_unused]] OnLoad on_load;
+} // namespace
+
+extern "C" VK_LAYER_EXPORT int SDL_PollEvent(SDL_Event *event) {
+  LoadReal(&real_SDL_PollEvent, "SDL_PollEvent");
+  OnPoll();
+  int ret = real_SDL_PollEvent(event);
+  if (!ret)
+    frame_polled.store(true);
+  return ret;
+}
+
+extern "C" VK_LAYER_EXPORT void SDL_PumpEvents() {
+  LoadReal(&real_SDL_PumpEvents, "SDL_PumpEvents");
+  OnPoll();
+  real_SDL_PumpEvents();
+  frame_polled.store(true);
+}
+
+extern "C" VK_LAYER_EXPORT void glfwPollEvents() {
+  LoadReal(&real_glfwPollEvents, "glfwPollEvents");
+  OnPoll();
+  real_glfwPollEvents();
+  frame_polled.store(true);
+}
@@ -15,20 +15,30 @@
 #include "latencyflex_layer.h"
 #include "version.h"
 
+#include <algorithm>
 #include <atomic>
+#include <cmath>
 #include <condition_variable>
 #include <cstring>
 #include <deque>
 #include <iostream>
 #include <map>
 #include <mutex>
+#include <optional>
+#include <sstream>
+#include <vector>
 
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include <vulkan/vk_layer.h>
 #include <vulkan/generated/vk_layer_dispatch_table.h>
 #include <vulkan/vulkan.h>
 
 #include "latencyflex.h"
+#include "latencyflex_config.h"
+#include "latencyflex_coordinate.h"
 
 #define LAYER_NAME "VK_LAYER_LFX_LatencyFleX"
 
@@ -36,19 +46,25 @@ namespace {
 std::atomic_uint64_t frame_counter = 0;
 std::atomic_bool ticker_needs_reset = false;
 std::atomic_uint64_t frame_counter_render = 0;
+// Frame the rendering thread last began working on, see lfx_MarkStage.
+std::atomic_uint64_t frame_counter_render_thread = 0;
 
 lfx::LatencyFleX manager;
 
 // Placebo mode. This turns off all sleeping but still retains latency and frame time tracking.
 // Useful for comparison benchmarks. Note that if the game does its own sleeping between the
 // syncpoint and input sampling, latency values from placebo mode might not be accurate.
-bool is_placebo_mode = false;
+std::atomic_bool is_placebo_mode = false;
 
 typedef void(VKAPI_PTR *PFN_overlay_SetMetrics)(const char **, const float *, size_t);
 PFN_overlay_SetMetrics overlay_SetMetrics = nullptr;
 
 const int kMaxFrameDrift = 16;
 const std::chrono::milliseconds kRecalibrationSleepTime(200);
+// Bound on the wait for a fence or semaphore passed to lfx_EndFrameOn*, and the interval at which
+// the wait checks whether the device is being destroyed.
+const uint64_t kAppSyncTimeout = 1000000000;
+const uint64_t kAppSyncPollInterval = 100000000;
 
 typedef std::lock_guard<std::mutex> scoped_lock;
 // single global lock, for simplicity
@@ -58,6 +74,14 @@ struct PresentInfo {
   VkDevice device;
   VkFence fence;
   uint64_t frame_id;
+  // Signaled after the work of the frame on the other queues. See QueueTracker.
+  std::vector<VkFence> queue_fences;
+  // Set if the application designated the end of the frame, see lfx_EndFrameOnFence. The fence
+  // then belongs to the application.
+  bool app_fence = false;
+  // Timeline semaphore value to wait for instead of the fence, see lfx_EndFrameOnSemaphore.
+  VkSemaphore semaphore = VK_NULL_HANDLE;
+  uint64_t semaphore_value = 0;
 };
 
 // use the loader's dispatch table pointer as a key for dispatch map lookups
@@ -68,37 +92,926 @@ std::map<void *, VkLayerInstanceDispatchTable> instance_dispatch;
 std::map<void *, VkLayerDispatchTable> device_dispatch;
 std::map<void *, VkDevice> device_map;
 
+// Mean and variance of a value over the lifetime of a device, logged when the device is destroyed.
+// Used to compare the effect of options such as queue_priority across runs.
+struct RunningStats {
+  uint64_t count = 0;
+  double mean = 0;
+  double m2 = 0;
+
+  void Add(double value) {
+    count++;
+    double delta = value - mean;
+    mean += delta / count;
+    m2 += delta * (value - mean);
+  }
+
+  double Variance() const { return count > 1 ? m2 / (count - 1) : 0; }
+};
+
+RunningStats latency_stats;
+RunningStats gpu_utilization_stats;
+
+// Statistics of the layer's own behavior, collected if call_stats is set, to compare layer changes
+// against replayed API streams (layer/bench/replay.sh). Overheads are the time spent in the layer
+// before calling down the chain, including calls the layer makes on its own behalf but excluding
+// intentional sleeps.
+enum CallStatsFunction { kCallSubmit, kCallPresent, kCallAcquire, kNumCallStatsFunctions };
+const char *const kCallStatsNames[] = {"vkQueueSubmit", "vkQueuePresentKHR",
+                                       "vkAcquireNextImageKHR"};
+
+struct CallStats {
+  RunningStats stats;
+  uint64_t max = 0;
+
+  void Add(uint64_t value) {
+    stats.Add(value);
+    max = std::max(max, value);
+  }
+};
+
+std::atomic_bool call_stats_enabled = false;
+// Separate from global_lock, as it is taken by calls that do not otherwise need that lock.
+std::mutex call_stats_lock;
+CallStats call_overhead[kNumCallStatsFunctions];
+// Frames waiting in the completion thread's queue when a frame is pushed to it, and the time it
+// takes to process a frame after its fence has signaled.
+CallStats completion_queue_depth;
+CallStats completion_processing;
+std::atomic_uint64_t recalibrations = 0;
+
+// Returns the start time of an intercepted call to measure, or 0 if call_stats is not set.
+uint64_t CallStatsBegin() {
+  return call_stats_enabled.load(std::memory_order_relaxed) ? current_time_ns() : 0;
+}
+
+void RecordCallOverhead(CallStatsFunction function, uint64_t call_begin, uint64_t excluded = 0) {
+  if (call_begin == 0)
+    return;
+  uint64_t overhead = current_time_ns() - call_begin - excluded;
+  scoped_lock l(call_stats_lock);
+  call_overhead[function].Add(overhead);
+}
+
+void RecordCompletion(CallStats *stats, uint64_t value) {
+  if (!call_stats_enabled.load(std::memory_order_relaxed))
+    return;
+  scoped_lock l(call_stats_lock);
+  stats->Add(value);
+}
+
+void ResetCallStats() {
+  scoped_lock l(call_stats_lock);
+  for (CallStats &stats : call_overhead)
+    stats = CallStats();
+  completion_queue_depth = CallStats();
+  completion_processing = CallStats();
+  recalibrations.store(0);
+}
+
+void LogCallStats() {
+  scoped_lock l(call_stats_lock);
+  for (size_t i = 0; i < kNumCallStatsFunctions; i++) {
+    const CallStats &overhead = call_overhead[i];
+    if (overhead.stats.count == 0)
+      continue;
+    std::cerr << "LatencyFleX: " << kCallStatsNames[i] << " overhead over "
+              << overhead.stats.count << " calls: mean=" << overhead.stats.mean / 1000.
+              << "us stddev=" << std::sqrt(overhead.stats.Variance()) / 1000.
+              << "us max=" << overhead.max / 1000. << "us" << std::endl;
+  }
+  if (completion_processing.stats.count > 0) {
+    std::cerr << "LatencyFleX: Completion thread over " << completion_processing.stats.count
+              << " frames: queue depth mean=" << completion_queue_depth.stats.mean
+              << " max=" << completion_queue_depth.max
+              << ", processing mean=" << completion_processing.stats.mean / 1000.
+              << "us max=" << completion_processing.max / 1000. << "us" << std::endl;
+  }
+  std::cerr << "LatencyFleX: Recalibrations: " << recalibrations.load() << std::endl;
+}
+
+// Holds presents by small, bounded amounts so that they leave at the estimated frame cadence,
+// smoothing out the jitter of frame delivery at the cost of that much display latency.
+class PresentPacer {
+public:
+  // Returns how long to hold a present that arrived at `now`. `frame_time` is the current
+  // estimate of the time between frames.
+  uint64_t Schedule(uint64_t now, double frame_time) const {
+    if (max_hold == 0 || prev_release_ == 0 || frame_time <= 0)
+      return 0;
+    // Aim slightly short of the cadence, so that holds do not accumulate into a standing delay
+    // when frames arrive exactly on time.
+    uint64_t due = prev_release_ + std::round(frame_time * kIntervalRatio);
+    if (due <= now)
+      return 0;
+    return std::min({due - now, max_hold, (uint64_t)std::round(frame_time * kMaxHoldRatio)});
+  }
+
+  // Account for a present that arrived at `arrival` and was released to the driver at `release`.
+  void Release(uint64_t arrival, uint64_t release) {
+    if (prev_arrival_ != 0) {
+      arrival_intervals.Add(arrival - prev_arrival_);
+      release_intervals.Add(release - prev_release_);
+      holds.Add(release - arrival);
+    }
+    prev_arrival_ = arrival;
+    prev_release_ = release;
+  }
+
+  // Maximum time to hold a present, or 0 to disable pacing.
+  uint64_t max_hold = 0;
+  RunningStats arrival_intervals;
+  RunningStats release_intervals;
+  RunningStats holds;
+
+private:
+  static constexpr double kIntervalRatio = 0.97;
+  static constexpr double kMaxHoldRatio = 0.25;
+
+  uint64_t prev_arrival_ = 0;
+  uint64_t prev_release_ = 0;
+};
+
+PresentPacer present_pacer;
+// Hold applied to the last present, for the overlay.
+std::atomic_uint64_t last_present_hold = 0;
+
+// Detects a frame limiter in the game that sleeps on the tick thread after lfx_WaitAndBeginFrame.
+// Both that limiter and LatencyFleX would then sleep every frame, and whatever the limiter sleeps
+// after input sampling is added latency. Once detected, the limiter's frame time is taken over as
+// target_frame_time, made slightly longer so that the limiter's deadline has always passed by the
+// time it checks, and its sleep goes away.
+class EngineLimiterDetector {
+public:
+  // Account for a tick. `interval` is the time since the previous tick, `idle` the time the tick
+  // thread spent neither running nor blocked in a call seen by the layer, and `presents` the
+  // number of presents since the previous tick. Returns the frame time to cap at, 0 to release a
+  // previously returned cap, or std::nullopt to leave the cap as is.
+  std::optional<uint64_t> Update(uint64_t interval, uint64_t idle, uint64_t presents) {
+    if (state_ == kDisabled)
+      return std::nullopt;
+    if (presents != 1) {
+      streak_ = 0;
+      return std::nullopt;
+    }
+    interval_.update(interval);
+    deviation_.update(std::abs((double)interval - interval_.get()));
+    idle_ratio_.update((double)idle / interval);
+
+    if (state_ == kVerifying) {
+      if (++streak_ < kWindow)
+        return std::nullopt;
+      streak_ = 0;
+      if (idle_ratio_.get() < idle_ratio_before_ / 2) {
+        state_ = kDetecting;
+        std::cerr << "LatencyFleX: Took over the in-game frame limiter" << std::endl;
+        return std::nullopt;
+      }
+      // Idle time that doesn't react to pacing isn't a limiter (e.g. waiting on another thread).
+      state_ = kDisabled;
+      std::cerr << "LatencyFleX: Idle time on the game thread is not a frame limiter, releasing cap"
+                << std::endl;
+      return 0;
+    }
+
+    bool stable = deviation_.get() < kStableRatio * interval_.get();
+    if (!stable || idle_ratio_.get() < kIdleRatio) {
+      streak_ = 0;
+      return std::nullopt;
+    }
+    if (++streak_ < kWindow)
+      return std::nullopt;
+    streak_ = 0;
+    state_ = kVerifying;
+    idle_ratio_before_ = idle_ratio_.get();
+    std::cerr << "LatencyFleX: In-game frame limiter detected at " << 1000000000 / interval_.get()
+              << " FPS" << std::endl;
+    return std::round(interval_.get() * (1 + kMargin));
+  }
+
+  // Start over after the measurements have been disturbed, e.g. by a recalibration.
+  void ResetWindow() {
+    streak_ = 0;
+    interval_ = lfx::internal::EwmaEstimator(kAlpha);
+    deviation_ = lfx::internal::EwmaEstimator(kAlpha);
+    idle_ratio_ = lfx::internal::EwmaEstimator(kAlpha);
+  }
+
+  void Disable() { state_ = kDisabled; }
+
+private:
+  enum State { kDetecting, kVerifying, kDisabled };
+  static constexpr double kAlpha = 0.1;
+  // Ticks the conditions must hold for before acting.
+  static constexpr int kWindow = 120;
+  // Maximum mean deviation of the tick interval, relative to the interval.
+  static constexpr double kStableRatio = 0.02;
+  // Minimum fraction of the tick interval spent idle.
+  static constexpr double kIdleRatio = 0.2;
+  static constexpr double kMargin = 0.005;
+
+  State state_ = kDetecting;
+  int streak_ = 0;
+  double idle_ratio_before_ = 0;
+  lfx::internal::EwmaEstimator interval_ = lfx::internal::EwmaEstimator(kAlpha);
+  lfx::internal::EwmaEstimator deviation_ = lfx::internal::EwmaEstimator(kAlpha);
+  lfx::internal::EwmaEstimator idle_ratio_ = lfx::internal::EwmaEstimator(kAlpha);
+};
+
+// Only accessed from the tick thread.
+EngineLimiterDetector engine_limiter;
+// Cap set on behalf of the in-game limiter, if any.
+uint64_t engine_limiter_cap = 0;
+std::atomic_bool engine_limiter_enabled = false;
+// Time the tick thread spent blocked in Vulkan calls since the last tick, and the wall and CPU
+// time at which the last tick returned.
+std::atomic_uint64_t tick_blocked_time = 0;
+uint64_t prev_tick_ts = 0;
+uint64_t prev_tick_end_ts = 0;
+uint64_t prev_tick_end_cpu = 0;
+uint64_t prev_tick_presents = 0;
+
+// Measures how a frame is laid out in time for coordination: how long after its begin the frame
+// is submitted, and how often frames are begun. The throughput estimate of the manager does not
+// serve for the latter, as it only covers the stages after the wait, and a game bound by its own
+// CPU work begins frames less often than that.
+class FrameCadence {
+public:
+  // Account for frame `frame_id` begun at `begin`. Called from the tick thread.
+  void Begin(uint64_t frame_id, uint64_t begin) {
+    if (prev_begin_ != 0 && begin > prev_begin_)
+      interval_.update(begin - prev_begin_);
+    prev_begin_ = begin;
+    uint64_t delay = last_submit_delay_.exchange(0);
+    if (delay != 0)
+      submit_delay_.update(delay);
+    Entry &entry = begins_[frame_id % kHistory];
+    entry.ts.store(begin, std::memory_order_relaxed);
+    entry.frame_id.store(frame_id, std::memory_order_release);
+  }
+
+  // Account for frame `frame_id` being presented at `present`. Called from the present thread.
+  void Present(uint64_t frame_id, uint64_t present) {
+    const Entry &entry = begins_[frame_id % kHistory];
+    if (entry.frame_id.load(std::memory_order_acquire) != frame_id)
+      return;
+    uint64_t begin = entry.ts.load(std::memory_order_relaxed);
+    if (present > begin)
+      last_submit_delay_.store(present - begin);
+  }
+
+  // Get the estimated time from frame begin to presentation, or 0 if not known yet.
+  double GetSubmitDelay() const { return submit_delay_.get(); }
+
+  // Get the estimated time between frame begins, or 0 if not known yet.
+  double GetInterval() const { return interval_.get(); }
+
+  // Start over, e.g. after a recalibration has reset the frame IDs. Called from the tick thread.
+  void Reset() {
+    for (Entry &entry : begins_)
+      entry.frame_id.store(0);
+    prev_begin_ = 0;
+    last_submit_delay_.store(0);
+    submit_delay_ = lfx::internal::EwmaEstimator(kAlpha);
+    interval_ = lfx::internal::EwmaEstimator(kAlpha);
+  }
+
+private:
+  static constexpr double kAlpha = 0.3;
+  static const size_t kHistory = kMaxFrameDrift + 1;
+
+  struct Entry {
+    std::atomic_uint64_t frame_id = 0;
+    std::atomic_uint64_t ts = 0;
+  };
+  Entry begins_[kHistory];
+  std::atomic_uint64_t last_submit_delay_ = 0;
+  uint64_t prev_begin_ = 0;
+  lfx::internal::EwmaEstimator submit_delay_ = lfx::internal::EwmaEstimator(kAlpha);
+  lfx::internal::EwmaEstimator interval_ = lfx::internal::EwmaEstimator(kAlpha);
+};
+
+// Shared with other instances when coordination is enabled. Protected by global_lock.
+lfx::coordinate::Channel coordination;
+// Set while the channel is open, for the paths that do not take global_lock.
+std::atomic_bool coordination_enabled = false;
+FrameCadence frame_cadence;
+// A GPU collision is only avoided if it takes at most this ratio of the frame time to move away
+// from it.
+const double kMaxInterleaveRatio = 0.5;
+// Shift applied to the last wake-up target to interleave with other instances, for the overlay.
+std::atomic_int64_t last_interleave_shift = 0;
+
+// Scheduler statistics of a thread, read from procfs: the time spent runnable but waiting for a
+// CPU, and the number of involuntary context switches (preemptions).
+class ThreadSchedStat {
+public:
+  ~ThreadSchedStat() { Close(); }
+
+  // Sample the totals of thread `tid`. Returns false if they are not available.
+  bool Sample(pid_t tid, uint64_t *wait_time, uint64_t *preemptions) {
+    if (tid != tid_) {
+      Close();
+      tid_ = tid;
+      std::string dir = "/proc/self/task/" + std::to_string(tid) + "/";
+      schedstat_fd_ = open((dir + "schedstat").c_str(), O_RDONLY | O_CLOEXEC);
+      status_fd_ = open((dir + "status").c_str(), O_RDONLY | O_CLOEXEC);
+    }
+    char buf[2048];
+    ssize_t len = schedstat_fd_ >= 0 ? pread(schedstat_fd_, buf, sizeof(buf) - 1, 0) : -1;
+    if (len <= 0)
+      return false;
+    buf[len] = '\0';
+    // Fields: time on CPU, time waiting on a run queue, number of timeslices.
+    unsigned long long run, wait;
+    if (sscanf(buf, "%llu %llu", &run, &wait) != 2)
+      return false;
+    // The status file grows with the number of CPUs and NUMA nodes in the affinity masks, so it is
+    // read in chunks.
+    if (status_fd_ < 0)
+      return false;
+    status_.clear();
+    while ((len = pread(status_fd_, buf, sizeof(buf), status_.size())) > 0)
+      status_.append(buf, len);
+    if (len < 0)
+      return false;
+    const char *field = strstr(status_.c_str(), "nonvoluntary_ctxt_switches:");
+    if (!field)
+      return false;
+    *wait_time = wait;
+    *preemptions = strtoull(field + strlen("nonvoluntary_ctxt_switches:"), nullptr, 10);
+    return true;
+  }
+
+private:
+  void Close() {
+    if (schedstat_fd_ >= 0)
+      close(schedstat_fd_);
+    if (status_fd_ >= 0)
+      close(status_fd_);
+    schedstat_fd_ = status_fd_ = -1;
+  }
+
+  pid_t tid_ = 0;
+  int schedstat_fd_ = -1;
+  int status_fd_ = -1;
+  std::string status_;
+};
+
+// Scheduler contention of a thread over the last tick.
+struct SchedContention {
+  ThreadSchedStat stat;
+  uint64_t prev_wait_time = UINT64_MAX;
+  uint64_t prev_preemptions = 0;
+  std::atomic_uint64_t wait_time = 0;
+  std::atomic_uint64_t preemptions = 0;
+
+  // `wait_counter` and `preemption_counter` name the trace counters, and must be string literals.
+  void Update(pid_t tid, const char *wait_counter, const char *preemption_counter) {
+    uint64_t wait_total, preemptions_total;
+    if (tid == 0 || !stat.Sample(tid, &wait_total, &preemptions_total)) {
+      prev_wait_time = UINT64_MAX;
+      return;
+    }
+    if (prev_wait_time != UINT64_MAX && wait_total >= prev_wait_time &&
+        preemptions_total >= prev_preemptions) {
+      wait_time.store(wait_total - prev_wait_time);
+      preemptions.store(preemptions_total - prev_preemptions);
+      TRACE_COUNTER("latencyflex", wait_counter, wait_time.load());
+      TRACE_COUNTER("latencyflex", preemption_counter, preemptions.load());
+    }
+    prev_wait_time = wait_total;
+    prev_preemptions = preemptions_total;
+  }
+};
+
+// Sampled at every tick if sched_stats is set, for the tick thread and the thread waiting for
+// frame completion, whose delays inflate the measured latency.
+std::atomic_bool sched_stats_enabled = false;
+SchedContention tick_contention;
+SchedContention completion_contention;
+std::atomic<pid_t> completion_tid = 0;
+
+// Threads on the critical path of a frame: the one calling lfx_WaitAndBeginFrame, and the one
+// presenting. Pipeline compiles on other threads (e.g. background compile workers) do not delay
+// frames and are not counted as stalls.
+std::atomic<std::thread::id> tick_thread;
+std::atomic<std::thread::id> present_thread;
+// Time the tick thread spent blocked on the GPU since the last tick, and when the last wait
+// returned.
+std::atomic_uint64_t sync_stall_time = 0;
+std::atomic_uint64_t sync_stall_end = 0;
+// Global queue priority granted to the graphics queues, for the stats log.
+const char *queue_priority_state = "default";
+
+// Account for a frame being submitted for presentation. Returns the ID of the frame.
+uint64_t BeginPresent() {
+  present_thread.store(std::this_thread::get_id(), std::memory_order_relaxed);
+  frame_counter_render++;
+  uint64_t frame_counter_local = frame_counter.load();
+  uint64_t frame_counter_render_local = frame_counter_render.load();
+  if (frame_counter_local > frame_counter_render_local + kMaxFrameDrift) {
+    ticker_needs_reset.store(true);
+  }
+  if (coordination_enabled.load(std::memory_order_relaxed))
+    frame_cadence.Present(frame_counter_render_local, current_time_ns());
+  return frame_counter_render_local;
+}
+
+// Report that the rendering work of a frame has completed at `complete`.
+void CompleteFrame(uint64_t frame_id, uint64_t complete) {
+  uint64_t latency;
+  double render_thread_time;
+  uint64_t compile_time;
+  uint64_t sync_stall;
+  double gpu_utilization;
+  bool pacing;
+  bool coordinating;
+  {
+    scoped_lock l(global_lock);
+    pacing = present_pacer.max_hold != 0;
+    coordinating = coordination.is_open();
+    manager.EndFrame(frame_id, complete, &latency, nullptr);
+    render_thread_time = manager.GetRenderThreadTime();
+    compile_time = manager.GetLastCompileTime();
+    sync_stall = manager.GetLastSyncStall();
+    gpu_utilization = manager.GetLastGpuUtilization();
+    if (latency != UINT64_MAX)
+      latency_stats.Add(latency);
+    if (gpu_utilization >= 0)
+      gpu_utilization_stats.Add(gpu_utilization);
+  }
+  if (overlay_SetMetrics && latency != UINT64_MAX) {
+    // Latency, render thread, compile and sync stall, GPU utilization, present hold, interleave
+    // shift and the four scheduler statistics.
+    const size_t kMaxMetrics = 11;
+    const char *names[kMaxMetrics];
+    float values[kMaxMetrics];
+    size_t count = 0;
+    auto add = [&](const char *name, float value) {
+      // Bounded so that a metric added without raising the capacity is dropped instead of
+      // overflowing.
+      if (count < kMaxMetrics) {
+        names[count] = name;
+        values[count++] = value;
+      }
+    };
+    add("Latency", latency / 1000000.f);
+    // Render thread time is only available if the render begin/end stages are reported.
+    if (render_thread_time > 0)
+      add("Render Thread", render_thread_time / 1000000.);
+    add("Compile Stall", compile_time / 1000000.f);
+    add("Sync Stall", sync_stall / 1000000.f);
+    if (gpu_utilization >= 0)
+      add("GPU Utilization", gpu_utilization * 100);
+    if (pacing)
+      add("Present Hold", last_present_hold.load() / 1000000.f);
+    if (coordinating)
+      add("Interleave Shift", last_interleave_shift.load() / 1000000.f);
+    if (sched_stats_enabled.load()) {
+      add("Run Queue Delay", tick_contention.wait_time.load() / 1000000.f);
+      add("Preemptions", tick_contention.preemptions.load());
+      add("Completion Run Queue Delay", completion_contention.wait_time.load() / 1000000.f);
+      add("Completion Preemptions", completion_contention.preemptions.load());
+    }
+    overlay_SetMetrics(names, values, count);
+  }
+}
+
+// Apply the settings from the config file and the environment. Called at load time and again
+// whenever the config file changes.
+void ApplyConfig() {
+  std::optional<double> max_fps = lfx::config::GetDouble("max_fps");
+  double up_factor = lfx::config::GetDouble("up_factor").value_or(lfx::LatencyFleX::kDefaultUpFactor);
+  double down_factor =
+      lfx::config::GetDouble("down_factor").value_or(lfx::LatencyFleX::kDefaultDownFactor);
+  bool placebo = lfx::config::GetBool("placebo");
+  bool detect_limiter = lfx::config::GetBool("detect_engine_limiter");
+  double present_pacing = lfx::config::GetDouble("present_pacing").value_or(0);
+  bool sched_stats = lfx::config::GetBool("sched_stats");
+  bool call_stats = lfx::config::GetBool("call_stats");
+  bool coordinate = lfx::config::GetBool("coordinate");
+
+  scoped_lock l(global_lock);
+  // Only undo a cap that was set by the config, not one set with lfx_SetTargetFrameTime.
+  static bool config_cap_applied = false;
+  if (max_fps || config_cap_applied) {
+    manager.target_frame_time = max_fps && *max_fps > 0 ? std::round(1000000000 / *max_fps) : 0;
+    config_cap_applied = max_fps.has_value();
+    std::cerr << "LatencyFleX: setting target frame time to " << manager.target_frame_time
+              << std::endl;
+  }
+  manager.SetFactors(up_factor, down_factor);
+  if (!detect_limiter && engine_limiter_cap != 0) {
+    if (manager.target_frame_time == engine_limiter_cap)
+      manager.target_frame_time = 0;
+    engine_limiter_cap = 0;
+  }
+  engine_limiter_enabled.store(detect_limiter);
+  uint64_t max_hold = present_pacing > 0 ? std::round(present_pacing * 1000000) : 0;
+  if (present_pacer.max_hold != max_hold) {
+    present_pacer.max_hold = max_hold;
+    std::cerr << "LatencyFleX: setting maximum present hold to " << max_hold << std::endl;
+  }
+  sched_stats_enabled.store(sched_stats);
+  call_stats_enabled.store(call_stats);
+  if (coordinate && !coordination.is_open()) {
+    if (coordination.Open()) {
+      coordination_enabled.store(true);
+      std::cerr << "LatencyFleX: Coordinating GPU work with other instances" << std::endl;
+    }
+  } else if (!coordinate && coordination.is_open()) {
+    coordination.Close();
+    coordination_enabled.store(false);
+    last_interleave_shift.store(0);
+    std::cerr << "LatencyFleX: Stopped coordinating with other instances" << std::endl;
+  }
+  if (is_placebo_mode.exchange(placebo) != placebo)
+    std::cerr << "LatencyFleX: " << (placebo ? "Running in placebo mode" : "Placebo mode disabled")
+              << std::endl;
+}
+
+#ifdef VK_EXT_layer_settings
+std::optional<std::string> LayerSettingToString(const VkLayerSettingEXT &setting) {
+  std::ostringstream os;
+  os.precision(17);
+  switch (setting.type) {
+  case VK_LAYER_SETTING_TYPE_BOOL32_EXT:
+    os << (*static_cast<const VkBool32 *>(setting.pValues) ? 1 : 0);
+    break;
+  case VK_LAYER_SETTING_TYPE_INT32_EXT:
+    os << *static_cast<const int32_t *>(setting.pValues);
+    break;
+  case VK_LAYER_SETTING_TYPE_INT64_EXT:
+    os << *static_cast<const int64_t *>(setting.pValues);
+    break;
+  case VK_LAYER_SETTING_TYPE_UINT32_EXT:
+    os << *static_cast<const uint32_t *>(setting.pValues);
+    break;
+  case VK_LAYER_SETTING_TYPE_UINT64_EXT:
+    os << *static_cast<const uint64_t *>(setting.pValues);
+    break;
+  case VK_LAYER_SETTING_TYPE_FLOAT32_EXT:
+    os << *static_cast<const float *>(setting.pValues);
+    break;
+  case VK_LAYER_SETTING_TYPE_FLOAT64_EXT:
+    os << *static_cast<const double *>(setting.pValues);
+    break;
+  case VK_LAYER_SETTING_TYPE_STRING_EXT:
+    os << *static_cast<const char *const *>(setting.pValues);
+    break;
+  default:
+    return std::nullopt;
+  }
+  return os.str();
+}
+
+// Take the settings passed by the application through VK_EXT_layer_settings. These use the same
+// keys as the config file, and take precedence over it but not over environment variables.
+void ApplyLayerSettings(const VkInstanceCreateInfo *pCreateInfo) {
+  bool found = false;
+  for (auto *info = static_cast<const VkBaseInStructure *>(pCreateInfo->pNext); info;
+       info = info->pNext) {
+    if (info->sType != VK_STRUCTURE_TYPE_LAYER_SETTINGS_CREATE_INFO_EXT)
+      continue;
+    auto *settings_info = reinterpret_cast<const VkLayerSettingsCreateInfoEXT *>(info);
+    for (uint32_t i = 0; i < settings_info->settingCount; i++) {
+      const VkLayerSettingEXT &setting = settings_info->pSettings[i];
+      if (!setting.pLayerName || strcmp(setting.pLayerName, LAYER_NAME) ||
+          !setting.pSettingName || setting.valueCount == 0)
+        continue;
+      std::optional<std::string> value = LayerSettingToString(setting);
+      if (!value) {
+        std::cerr << "LatencyFleX: Unsupported type for layer setting " << setting.pSettingName
+                  << std::endl;
+        continue;
+      }
+      lfx::config::SetOverride(setting.pSettingName, *value);
+      found = true;
+    }
+  }
+  if (found)
+    ApplyConfig();
+}
+#endif
+
+// Measures the GPU time of each frame with timestamp queries on the queue it is presented from.
+// One timestamp is written at the start of the first submission to that queue after a present,
+// the other one after the frame's work, in the submission signaling the completion fence.
+class GpuTimer {
+public:
+  GpuTimer(VkDevice device, VkLayerDispatchTable &dispatch,
+           PFN_vkSetDeviceLoaderData set_loader_data, VkQueue queue, uint32_t queue_family,
+           uint32_t valid_bits, float period)
+      : device_(device), dispatch_(dispatch), queue_(queue), period_(period),
+        mask_(valid_bits >= 64 ? UINT64_MAX : (UINT64_C(1) << valid_bits) - 1) {
+    VkQueryPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    poolInfo.queryCount = 2 * kSlots;
+    if (dispatch_.CreateQueryPool(device_, &poolInfo, nullptr, &query_pool_) != VK_SUCCESS)
+      return;
+    VkCommandPoolCreateInfo cmdPoolInfo{};
+    cmdPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    cmdPoolInfo.queueFamilyIndex = queue_family;
+    if (dispatch_.CreateCommandPool(device_, &cmdPoolInfo, nullptr, &cmd_pool_) != VK_SUCCESS)
+      return;
+    VkCommandBufferAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.commandPool = cmd_pool_;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandBufferCount = kSlots;
+    if (dispatch_.AllocateCommandBuffers(device_, &allocInfo, begin_cmds_) != VK_SUCCESS ||
+        dispatch_.AllocateCommandBuffers(device_, &allocInfo, end_cmds_) != VK_SUCCESS)
+      return;
+
+    // The command buffers are recorded once and reused; a slot is not reused before the frame
+    // that used it last has completed.
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    for (uint32_t slot = 0; slot < kSlots; slot++) {
+      // Command buffers allocated by a layer need the loader's dispatch pointer.
+      set_loader_data(device_, begin_cmds_[slot]);
+      set_loader_data(device_, end_cmds_[slot]);
+      dispatch_.BeginCommandBuffer(begin_cmds_[slot], &beginInfo);
+      dispatch_.CmdResetQueryPool(begin_cmds_[slot], query_pool_, 2 * slot, 2);
+      dispatch_.CmdWriteTimestamp(begin_cmds_[slot], VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                                  query_pool_, 2 * slot);
+      dispatch_.EndCommandBuffer(begin_cmds_[slot]);
+      dispatch_.BeginCommandBuffer(end_cmds_[slot], &beginInfo);
+      dispatch_.CmdWriteTimestamp(end_cmds_[slot], VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                                  query_pool_, 2 * slot + 1);
+      dispatch_.EndCommandBuffer(end_cmds_[slot]);
+    }
+    std::fill(std::begin(begun_), std::end(begun_), UINT64_MAX);
+    std::fill(std::begin(ended_), std::end(ended_), UINT64_MAX);
+    ok_ = true;
+  }
+
+  ~GpuTimer() {
+    if (cmd_pool_ != VK_NULL_HANDLE)
+      dispatch_.DestroyCommandPool(device_, cmd_pool_, nullptr);
+    if (query_pool_ != VK_NULL_HANDLE)
+      dispatch_.DestroyQueryPool(device_, query_pool_, nullptr);
+  }
+
+  bool Ok() const { return ok_; }
+
+  VkQueue Queue() const { return queue_; }
+
+  // Get the command buffer to run before the work of `frame_id`, or VK_NULL_HANDLE if one has
+  // already been submitted for the frame.
+  VkCommandBuffer BeginFrame(uint64_t frame_id) {
+    uint32_t slot = frame_id % kSlots;
+    if (begun_[slot] == frame_id)
+      return VK_NULL_HANDLE;
+    begun_[slot] = frame_id;
+    ended_[slot] = UINT64_MAX;
+    return begin_cmds_[slot];
+  }
+
+  // Get the command buffer to run after the work of `frame_id`, or VK_NULL_HANDLE if the frame
+  // has no work on the queue.
+  VkCommandBuffer EndFrame(uint64_t frame_id) {
+    uint32_t slot = frame_id % kSlots;
+    if (begun_[slot] != frame_id)
+      return VK_NULL_HANDLE;
+    // Frame IDs restart after a recalibration.
+    begun_[slot] = UINT64_MAX;
+    ended_[slot] = frame_id;
+    return end_cmds_[slot];
+  }
+
+  // Read back the GPU time of `frame_id`, after its completion fence has signaled. See
+  // LatencyFleX::ReportGpuTime for the meaning of `busy` and `idle`.
+  bool Read(uint64_t frame_id, uint64_t *busy, uint64_t *idle) {
+    uint32_t slot = frame_id % kSlots;
+    if (ended_[slot] != frame_id)
+      return false;
+    ended_[slot] = UINT64_MAX;
+    uint64_t ticks[2];
+    if (dispatch_.GetQueryPoolResults(device_, query_pool_, 2 * slot, 2, sizeof(ticks), ticks,
+                                      sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS)
+      return false;
+    uint64_t begin = ticks[0] & mask_;
+    uint64_t end = ticks[1] & mask_;
+    uint64_t prev_end = prev_end_;
+    prev_end_ = end;
+    // Also rejects wraparound of the timestamp counter.
+    if (end < begin || prev_end == 0 || end < prev_end)
+      return false;
+    // Work of consecutive frames can overlap, in which case the GPU was never idle.
+    *busy = std::round((end - std::max(begin, prev_end)) * period_);
+    *idle = begin > prev_end ? std::round((begin - prev_end) * period_) : 0;
+    return true;
+  }
+
+private:
+  static const uint32_t kSlots = 16;
+
+  VkDevice device_;
+  VkLayerDispatchTable &dispatch_;
+  VkQueue queue_;
+  float period_;
+  uint64_t mask_;
+  bool ok_ = false;
+  VkQueryPool query_pool_ = VK_NULL_HANDLE;
+  VkCommandPool cmd_pool_ = VK_NULL_HANDLE;
+  VkCommandBuffer begin_cmds_[kSlots] = {};
+  VkCommandBuffer end_cmds_[kSlots] = {};
+  uint64_t begun_[kSlots];
+  uint64_t ended_[kSlots];
+  uint64_t prev_end_ = 0;
+};
+
+// Per-device parameters for GPU timing, and the timer once the presenting queue is known.
+struct GpuTiming {
+  PFN_vkSetDeviceLoaderData set_loader_data = nullptr;
+  float period = 1;
+  std::vector<uint32_t> valid_bits;
+  std::unique_ptr<GpuTimer> timer;
+  // Set if the timer could not be created, so that it is not retried on every present.
+  bool failed = false;
+};
+
+std::map<void *, GpuTiming> gpu_timing;
+// Queue family of each queue retrieved by the application.
+std::map<VkQueue, uint32_t> queue_families;
+
+// Tracks the work submitted to queues other than the presenting one, such as post-processing on
+// an async compute queue that finishes after graphics, so that a frame only completes once the
+// work of every queue has. At each present, an empty batch is submitted to each queue that has
+// received work since the previous present, signaling a fence from a pool once that work is done.
+// The fences are handed to the wait thread along with the frame. Queues of transfer-only families
+// are not tracked, as they mostly carry streaming uploads that are not part of any frame.
+//
+// All methods must be called with global_lock held. The application's use of a tracked queue is
+// serialized with the layer's through the queue's own lock instead.
+class QueueTracker {
+public:
+  struct Queue {
+    std::mutex lock;
+    // Set if work has been submitted since the previous present. Guarded by `lock`.
+    bool pending = false;
+  };
+
+  QueueTracker(VkDevice device, VkLayerDispatchTable &dispatch,
+               std::vector<VkQueueFlags> &&family_flags)
+      : device_(device), dispatch_(dispatch), family_flags_(std::move(family_flags)) {}
+
+  ~QueueTracker() {
+    for (VkFence fence : free_)
+      dispatch_.DestroyFence(device_, fence, nullptr);
+  }
+
+  // Get the state of `queue`, or nullptr if the queue is not tracked. Tracking starts after the
+  // first present, so that setup work such as uploads at load time is not attributed to the first
+  // frame.
+  Queue *Find(VkQueue queue) {
+    if (present_queue_ == VK_NULL_HANDLE || queue == present_queue_)
+      return nullptr;
+    auto it = queues_.find(queue);
+    if (it != queues_.end())
+      return it->second.get();
+    auto family = queue_families.find(queue);
+    if (family == queue_families.end() || family->second >= family_flags_.size() ||
+        !(family_flags_[family->second] & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)))
+      return nullptr;
+    return queues_.emplace(queue, std::make_unique<Queue>()).first->second.get();
+  }
+
+  // Get fences signaled once the work submitted to the other queues before this present on
+  // `present_queue` has completed. A queue in use by the application at the moment is skipped
+  // rather than waited for.
+  std::vector<VkFence> Present(VkQueue present_queue) {
+    present_queue_ = present_queue;
+    std::vector<VkFence> fences;
+    for (auto &queue : queues_) {
+      if (queue.first == present_queue)
+        continue;
+      std::unique_lock<std::mutex> l(queue.second->lock, std::try_to_lock);
+      if (!l.owns_lock() || !queue.second->pending)
+        continue;
+      VkFence fence = AcquireFence();
+      if (fence == VK_NULL_HANDLE)
+        continue;
+      // A submission without batches signals its fence once all work before it has completed.
+      if (dispatch_.QueueSubmit(queue.first, 0, nullptr, fence) != VK_SUCCESS) {
+        free_.push_back(fence);
+        continue;
+      }
+      queue.second->pending = false;
+      fences.push_back(fence);
+    }
+    return fences;
+  }
+
+  // Return fences that have signaled to the pool.
+  void Release(const std::vector<VkFence> &fences) {
+    if (fences.empty())
+      return;
+    dispatch_.ResetFences(device_, fences.size(), fences.data());
+    free_.insert(free_.end(), fences.begin(), fences.end());
+  }
+
+private:
+  VkFence AcquireFence() {
+    if (!free_.empty()) {
+      VkFence fence = free_.back();
+      free_.pop_back();
+      return fence;
+    }
+    VkFenceCreateInfo fenceInfo{};
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    VkFence fence;
+    if (dispatch_.CreateFence(device_, &fenceInfo, nullptr, &fence) != VK_SUCCESS)
+      return VK_NULL_HANDLE;
+    return fence;
+  }
+
+  VkDevice device_;
+  VkLayerDispatchTable &dispatch_;
+  std::vector<VkQueueFlags> family_flags_;
+  VkQueue present_queue_ = VK_NULL_HANDLE;
+  std::vector<VkFence> free_;
+  std::map<VkQueue, std::unique_ptr<Queue>> queues_;
+};
+
+std::map<void *, std::unique_ptr<QueueTracker>> queue_trackers;
+
+// Get the tracking state of `queue`, or nullptr if it is not tracked. Must be called with
+// global_lock held.
+QueueTracker::Queue *FindTrackedQueue(VkQueue queue) {
+  auto it = queue_trackers.find(GetKey(queue));
+  return it != queue_trackers.end() ? it->second->Find(queue) : nullptr;
+}
+
 class FenceWaitThread {
 public:
   FenceWaitThread();
 
   ~FenceWaitThread();
 
-  void Push(PresentInfo &&info) {
+  // Returns the number of frames queued before this one.
+  size_t Push(PresentInfo &&info) {
     scoped_lock l(local_lock_);
     queue_.push_back(info);
     notify_.notify_all();
+    return queue_.size() - 1;
   }
 
 private:
   void Worker();
 
-  std::thread thread_;
+  bool WaitForApp(const VkLayerDispatchTable &dispatch, const PresentInfo &info);
+
   std::mutex local_lock_;
   std::condition_variable notify_;
   std::deque<PresentInfo> queue_;
   bool running_ = true;
+  // Declared last, so that the worker starts after the members it uses are initialized.
+  std::thread thread_;
 };
 
 FenceWaitThread::FenceWaitThread() : thread_(&FenceWaitThread::Worker, this) {}
 
 FenceWaitThread::~FenceWaitThread() {
-  running_ = false;
+  {
+    scoped_lock l(local_lock_);
+    running_ = false;
+  }
   notify_.notify_all();
   thread_.join();
 }
 
+// Waits on the fence or semaphore the application ended a frame on. The application may never signal
+// it, for example when it destroys the device with the work unsubmitted, so the wait is given up
+// after kAppSyncTimeout or once the thread is asked to stop. Returns whether it was signaled.
+bool FenceWaitThread::WaitForApp(const VkLayerDispatchTable &dispatch, const PresentInfo &info) {
+  for (uint64_t waited = 0; waited < kAppSyncTimeout; waited += kAppSyncPollInterval) {
+    VkResult ret;
+    if (info.semaphore != VK_NULL_HANDLE) {
+      VkSemaphoreWaitInfo waitInfo{};
+      waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+      waitInfo.semaphoreCount = 1;
+      waitInfo.pSemaphores = &info.semaphore;
+      waitInfo.pValues = &info.semaphore_value;
+      ret = (dispatch.WaitSemaphores ? dispatch.WaitSemaphores : dispatch.WaitSemaphoresKHR)(
+          info.device, &waitInfo, kAppSyncPollInterval);
+    } else {
+      ret = dispatch.WaitForFences(info.device, 1, &info.fence, VK_TRUE, kAppSyncPollInterval);
+    }
+    if (ret != VK_TIMEOUT)
+      return ret == VK_SUCCESS;
+    scoped_lock l(local_lock_);
+    if (!running_)
+      return false;
+  }
+  return false;
+}
+
 void FenceWaitThread::Worker() {
+  completion_tid.store(syscall(SYS_gettid));
   while (true) {
     PresentInfo info;
     {
@@ -113,20 +1026,40 @@ void FenceWaitThread::Worker() {
     }
     VkDevice device = info.device;
     VkLayerDispatchTable &dispatch = device_dispatch[GetKey(info.device)];
-    dispatch.WaitForFences(device, 1, &info.fence, VK_TRUE, -1);
+    if (info.app_fence || info.semaphore != VK_NULL_HANDLE) {
+      if (!WaitForApp(dispatch, info)) {
+        static std::atomic<bool> logged{false};
+        if (!logged.exchange(true))
+          std::cerr << "LatencyFleX: Frame end fence or semaphore not signaled in time, dropping "
+                       "the frame"
+                    << std::endl;
+        continue;
+      }
+    } else {
+      dispatch.WaitForFences(device, 1, &info.fence, VK_TRUE, -1);
+    }
+    // The frame is complete once the last queue is done with it.
+    if (!info.queue_fences.empty())
+      dispatch.WaitForFences(device, info.queue_fences.size(), info.queue_fences.data(), VK_TRUE,
+                             -1);
     uint64_t complete = current_time_ns();
-    dispatch.DestroyFence(device, info.fence, nullptr);
-
-    uint64_t latency;
+    if (info.fence != VK_NULL_HANDLE && !info.app_fence)
+      dispatch.DestroyFence(device, info.fence, nullptr);
     {
       scoped_lock l(global_lock);
-      manager.EndFrame(info.frame_id, complete, &latency, nullptr);
-    }
-    float latency_f = latency / 1000000.;
-    const char *name = "Latency";
-    if (overlay_SetMetrics && latency != UINT64_MAX) {
-      overlay_SetMetrics(&name, &latency_f, 1);
+      auto tracker = queue_trackers.find(GetKey(device));
+      if (tracker != queue_trackers.end())
+        tracker->second->Release(info.queue_fences);
+      auto it = gpu_timing.find(GetKey(device));
+      uint64_t busy, idle;
+      if (it != gpu_timing.end() && it->second.timer &&
+          it->second.timer->Read(info.frame_id, &busy, &idle)) {
+        manager.ReportGpuTime(info.frame_id, busy, idle);
+      }
     }
+
+    CompleteFrame(info.frame_id, complete);
+    RecordCompletion(&completion_processing, current_time_ns() - complete);
   }
 }
 
@@ -159,6 +1092,10 @@ VkResult VKAPI_CALL lfx_CreateInstance(const VkInstanceCreateInfo *pCreateInfo,
 
   PFN_vkCreateInstance createFunc = (PFN_vkCreateInstance)gpa(VK_NULL_HANDLE, "vkCreateInstance");
 
+#ifdef VK_EXT_layer_settings
+  ApplyLayerSettings(pCreateInfo);
+#endif
+
   VkResult ret = createFunc(pCreateInfo, pAllocator, pInstance);
   if (ret != VK_SUCCESS)
     return ret;
@@ -170,6 +1107,11 @@ VkResult VKAPI_CALL lfx_CreateInstance(const VkInstanceCreateInfo *pCreateInfo,
   dispatchTable.DestroyInstance = (PFN_vkDestroyInstance)gpa(*pInstance, "vkDestroyInstance");
   dispatchTable.EnumerateDeviceExtensionProperties = (PFN_vkEnumerateDeviceExtensionProperties)gpa(
       *pInstance, "vkEnumerateDeviceExtensionProperties");
+  dispatchTable.GetPhysicalDeviceQueueFamilyProperties =
+      (PFN_vkGetPhysicalDeviceQueueFamilyProperties)gpa(*pInstance,
+                                                        "vkGetPhysicalDeviceQueueFamilyProperties");
+  dispatchTable.GetPhysicalDeviceProperties =
+      (PFN_vkGetPhysicalDeviceProperties)gpa(*pInstance, "vkGetPhysicalDeviceProperties");
 
   // store the table by key
   {
@@ -190,6 +1132,103 @@ void VKAPI_CALL lfx_DestroyInstance(VkInstance instance, const VkAllocationCallb
   instance_dispatch.erase(GetKey(instance));
 }
 
+// A copy of the application's device create info with an elevated global priority chained onto
+// the graphics queues. Requested with the queue_priority option ("high" or "realtime"), so that
+// frames spend less time queued behind the work of other processes in the GPU scheduler.
+struct QueuePriorityRequest {
+  VkDeviceCreateInfo create_info;
+  std::vector<VkDeviceQueueCreateInfo> queue_infos;
+  std::vector<VkDeviceQueueGlobalPriorityCreateInfoKHR> priority_infos;
+  std::vector<const char *> extensions;
+  const char *priority_name;
+};
+
+// Returns false if the option is off, or the device does not support global priorities.
+bool PrepareQueuePriority(VkPhysicalDevice physicalDevice, const VkDeviceCreateInfo *pCreateInfo,
+                          QueuePriorityRequest *request) {
+  std::optional<std::string> option = lfx::config::Get("queue_priority");
+  if (!option || *option == "default")
+    return false;
+  VkQueueGlobalPriorityKHR priority;
+  if (*option == "high") {
+    priority = VK_QUEUE_GLOBAL_PRIORITY_HIGH_KHR;
+    request->priority_name = "high";
+  } else if (*option == "realtime") {
+    priority = VK_QUEUE_GLOBAL_PRIORITY_REALTIME_KHR;
+    request->priority_name = "realtime";
+  } else {
+    std::cerr << "LatencyFleX: Invalid queue priority " << *option << std::endl;
+    return false;
+  }
+
+  VkLayerInstanceDispatchTable dispatch;
+  {
+    scoped_lock l(global_lock);
+    dispatch = instance_dispatch[GetKey(physicalDevice)];
+  }
+  uint32_t count = 0;
+  dispatch.EnumerateDeviceExtensionProperties(physicalDevice, nullptr, &count, nullptr);
+  std::vector<VkExtensionProperties> extensions(count);
+  dispatch.EnumerateDeviceExtensionProperties(physicalDevice, nullptr, &count, extensions.data());
+  const char *extension = nullptr;
+  for (const char *name :
+       {VK_KHR_GLOBAL_PRIORITY_EXTENSION_NAME, VK_EXT_GLOBAL_PRIORITY_EXTENSION_NAME}) {
+    for (const VkExtensionProperties &props : extensions) {
+      if (!extension && !strcmp(props.extensionName, name))
+        extension = name;
+    }
+  }
+  if (!extension) {
+    std::cerr << "LatencyFleX: Global queue priority is not supported by the device" << std::endl;
+    return false;
+  }
+
+  dispatch.GetPhysicalDeviceQueueFamilyProperties(physicalDevice, &count, nullptr);
+  std::vector<VkQueueFamilyProperties> families(count);
+  dispatch.GetPhysicalDeviceQueueFamilyProperties(physicalDevice, &count, families.data());
+
+  request->queue_infos.assign(pCreateInfo->pQueueCreateInfos,
+                              pCreateInfo->pQueueCreateInfos + pCreateInfo->queueCreateInfoCount);
+  // Reserved up front, as the queue create infos point into this vector.
+  request->priority_infos.reserve(request->queue_infos.size());
+  for (VkDeviceQueueCreateInfo &info : request->queue_infos) {
+    if (info.queueFamilyIndex >= families.size() ||
+        !(families[info.queueFamilyIndex].queueFlags & VK_QUEUE_GRAPHICS_BIT))
+      continue;
+    // Respect a priority chosen by the application.
+    bool has_priority = false;
+    for (auto *ext = static_cast<const VkBaseInStructure *>(info.pNext); ext; ext = ext->pNext) {
+      if (ext->sType == VK_STRUCTURE_TYPE_DEVICE_QUEUE_GLOBAL_PRIORITY_CREATE_INFO_KHR)
+        has_priority = true;
+    }
+    if (has_priority)
+      continue;
+    request->priority_infos.push_back(
+        {VK_STRUCTURE_TYPE_DEVICE_QUEUE_GLOBAL_PRIORITY_CREATE_INFO_KHR, info.pNext, priority});
+    info.pNext = &request->priority_infos.back();
+  }
+  if (request->priority_infos.empty())
+    return false;
+
+  request->extensions.assign(pCreateInfo->ppEnabledExtensionNames,
+                             pCreateInfo->ppEnabledExtensionNames +
+                                 pCreateInfo->enabledExtensionCount);
+  bool enabled = false;
+  for (const char *name : request->extensions) {
+    if (!strcmp(name, VK_KHR_GLOBAL_PRIORITY_EXTENSION_NAME) ||
+        !strcmp(name, VK_EXT_GLOBAL_PRIORITY_EXTENSION_NAME))
+      enabled = true;
+  }
+  if (!enabled)
+    request->extensions.push_back(extension);
+
+  request->create_info = *pCreateInfo;
+  request->create_info.pQueueCreateInfos = request->queue_infos.data();
+  request->create_info.enabledExtensionCount = request->extensions.size();
+  request->create_info.ppEnabledExtensionNames = request->extensions.data();
+  return true;
+}
+
 VkResult VKAPI_CALL lfx_CreateDevice(VkPhysicalDevice physicalDevice,
                                      const VkDeviceCreateInfo *pCreateInfo,
                                      const VkAllocationCallbacks *pAllocator, VkDevice *pDevice) {
@@ -207,6 +1246,15 @@ VkResult VKAPI_CALL lfx_CreateDevice(VkPhysicalDevice physicalDevice,
     return VK_ERROR_INITIALIZATION_FAILED;
   }
 
+  // The loader callback to set up dispatch for command buffers allocated by the layer.
+  PFN_vkSetDeviceLoaderData set_loader_data = nullptr;
+  for (auto *info = (VkLayerDeviceCreateInfo *)pCreateInfo->pNext; info;
+       info = (VkLayerDeviceCreateInfo *)info->pNext) {
+    if (info->sType == VK_STRUCTURE_TYPE_LOADER_DEVICE_CREATE_INFO &&
+        info->function == VK_LOADER_DATA_CALLBACK)
+      set_loader_data = info->u.pfnSetDeviceLoaderData;
+  }
+
   PFN_vkGetInstanceProcAddr gipa = layerCreateInfo->u.pLayerInfo->pfnNextGetInstanceProcAddr;
   PFN_vkGetDeviceProcAddr gdpa = layerCreateInfo->u.pLayerInfo->pfnNextGetDeviceProcAddr;
   // move chain on for next layer
@@ -214,7 +1262,25 @@ VkResult VKAPI_CALL lfx_CreateDevice(VkPhysicalDevice physicalDevice,
 
   PFN_vkCreateDevice createFunc = (PFN_vkCreateDevice)gipa(VK_NULL_HANDLE, "vkCreateDevice");
 
-  VkResult ret = createFunc(physicalDevice, pCreateInfo, pAllocator, pDevice);
+  QueuePriorityRequest priority_request;
+  const char *priority_state = "default";
+  VkResult ret = VK_ERROR_INITIALIZATION_FAILED;
+  bool with_priority = PrepareQueuePriority(physicalDevice, pCreateInfo, &priority_request);
+  if (with_priority) {
+    // Usually fails with VK_ERROR_NOT_PERMITTED_KHR if the process lacks the privilege.
+    VkLayerDeviceLink *next_link = layerCreateInfo->u.pLayerInfo;
+    ret = createFunc(physicalDevice, &priority_request.create_info, pAllocator, pDevice);
+    if (ret == VK_SUCCESS) {
+      priority_state = priority_request.priority_name;
+    } else {
+      std::cerr << "LatencyFleX: Elevated queue priority denied (" << ret
+                << "), using the default priority" << std::endl;
+      // The next layer advanced the link info, rewind it before trying again.
+      layerCreateInfo->u.pLayerInfo = next_link;
+    }
+  }
+  if (!with_priority || ret != VK_SUCCESS)
+    ret = createFunc(physicalDevice, pCreateInfo, pAllocator, pDevice);
   if (ret != VK_SUCCESS)
     return ret;
 
@@ -228,24 +1294,119 @@ VkResult VKAPI_CALL lfx_CreateDevice(VkPhysicalDevice physicalDevice,
   ASSIGN_FUNCTION(AcquireNextImage2KHR);
   ASSIGN_FUNCTION(CreateFence);
   ASSIGN_FUNCTION(DestroyFence);
+  ASSIGN_FUNCTION(ResetFences);
+  ASSIGN_FUNCTION(GetFenceStatus);
   ASSIGN_FUNCTION(QueueSubmit);
   ASSIGN_FUNCTION(WaitForFences);
+  ASSIGN_FUNCTION(WaitSemaphores);
+  ASSIGN_FUNCTION(WaitSemaphoresKHR);
+  ASSIGN_FUNCTION(QueueWaitIdle);
+  ASSIGN_FUNCTION(DeviceWaitIdle);
+  ASSIGN_FUNCTION(CreateGraphicsPipelines);
+  ASSIGN_FUNCTION(CreateComputePipelines);
+  ASSIGN_FUNCTION(GetDeviceQueue);
+  ASSIGN_FUNCTION(GetDeviceQueue2);
+  ASSIGN_FUNCTION(QueueSubmit2);
+  ASSIGN_FUNCTION(QueueSubmit2KHR);
+  ASSIGN_FUNCTION(CreateQueryPool);
+  ASSIGN_FUNCTION(DestroyQueryPool);
+  ASSIGN_FUNCTION(GetQueryPoolResults);
+  ASSIGN_FUNCTION(CreateCommandPool);
+  ASSIGN_FUNCTION(DestroyCommandPool);
+  ASSIGN_FUNCTION(AllocateCommandBuffers);
+  ASSIGN_FUNCTION(BeginCommandBuffer);
+  ASSIGN_FUNCTION(EndCommandBuffer);
+  ASSIGN_FUNCTION(CmdResetQueryPool);
+  ASSIGN_FUNCTION(CmdWriteTimestamp);
 #undef ASSIGN_FUNCTION
 
+  VkLayerInstanceDispatchTable instance;
+  {
+    scoped_lock l(global_lock);
+    instance = instance_dispatch[GetKey(physicalDevice)];
+  }
+  uint32_t family_count = 0;
+  instance.GetPhysicalDeviceQueueFamilyProperties(physicalDevice, &family_count, nullptr);
+  std::vector<VkQueueFamilyProperties> families(family_count);
+  instance.GetPhysicalDeviceQueueFamilyProperties(physicalDevice, &family_count, families.data());
+
+  GpuTiming timing;
+  timing.set_loader_data = set_loader_data;
+  if (set_loader_data && lfx::config::GetBool("gpu_timing")) {
+    VkPhysicalDeviceProperties props;
+    instance.GetPhysicalDeviceProperties(physicalDevice, &props);
+    timing.period = props.limits.timestampPeriod;
+    for (const VkQueueFamilyProperties &family : families)
+      timing.valid_bits.push_back(family.timestampValidBits);
+  } else {
+    timing.failed = true;
+  }
+  bool multi_queue = lfx::config::GetBool("multi_queue");
+
   // store the table by key
   {
     scoped_lock l(global_lock);
     device_dispatch[GetKey(*pDevice)] = dispatchTable;
     device_map[GetKey(*pDevice)] = *pDevice;
     wait_threads[GetKey(*pDevice)] = std::make_unique<FenceWaitThread>();
+    gpu_timing[GetKey(*pDevice)] = std::move(timing);
+    if (multi_queue) {
+      std::vector<VkQueueFlags> family_flags;
+      for (const VkQueueFamilyProperties &family : families)
+        family_flags.push_back(family.queueFlags);
+      queue_trackers[GetKey(*pDevice)] = std::make_unique<QueueTracker>(
+          *pDevice, device_dispatch[GetKey(*pDevice)], std::move(family_flags));
+    }
+    latency_stats = RunningStats();
+    gpu_utilization_stats = RunningStats();
+    present_pacer.arrival_intervals = RunningStats();
+    present_pacer.release_intervals = RunningStats();
+    present_pacer.holds = RunningStats();
+    queue_priority_state = priority_state;
   }
+  ResetCallStats();
 
   return VK_SUCCESS;
 }
 
 void VKAPI_CALL lfx_DestroyDevice(VkDevice device, const VkAllocationCallbacks *pAllocator) {
+  std::unique_ptr<FenceWaitThread> wait_thread;
+  {
+    scoped_lock l(global_lock);
+    wait_thread = std::move(wait_threads[GetKey(device)]);
+    wait_threads.erase(GetKey(device));
+  }
+  // Joined without the lock, as completing the frames still in its queue requires it.
+  wait_thread.reset();
+
   scoped_lock l(global_lock);
-  wait_threads.erase(GetKey(device));
+  gpu_timing.erase(GetKey(device));
+  queue_trackers.erase(GetKey(device));
+  for (auto it = queue_families.begin(); it != queue_families.end();) {
+    if (GetKey(it->first) == GetKey(device))
+      it = queue_families.erase(it);
+    else
+      ++it;
+  }
+  if (gpu_utilization_stats.count > 0) {
+    std::cerr << "LatencyFleX: GPU utilization over " << gpu_utilization_stats.count
+              << " frames: mean=" << gpu_utilization_stats.mean * 100 << "%" << std::endl;
+  }
+  if (latency_stats.count > 0) {
+    std::cerr << "LatencyFleX: Latency over " << latency_stats.count
+              << " frames: mean=" << latency_stats.mean / 1000000.
+              << "ms stddev=" << std::sqrt(latency_stats.Variance()) / 1000000.
+              << "ms (queue priority: " << queue_priority_state << ")" << std::endl;
+  }
+  if (present_pacer.max_hold != 0 && present_pacer.holds.count > 0) {
+    std::cerr << "LatencyFleX: Present interval stddev over " << present_pacer.holds.count
+              << " frames: " << std::sqrt(present_pacer.arrival_intervals.Variance()) / 1000000.
+              << "ms unpaced, " << std::sqrt(present_pacer.release_intervals.Variance()) / 1000000.
+              << "ms paced, mean hold=" << present_pacer.holds.mean / 1000000. << "ms"
+              << std::endl;
+  }
+  if (call_stats_enabled.load())
+    LogCallStats();
   device_dispatch[GetKey(device)].DestroyDevice(device, pAllocator);
   device_dispatch.erase(GetKey(device));
   device_map.erase(GetKey(device));
@@ -281,10 +1442,24 @@ VkResult VKAPI_CALL lfx_EnumerateInstanceExtensionProperties(const char *pLayerN
   if (pLayerName == nullptr || strcmp(pLayerName, LAYER_NAME))
     return VK_ERROR_LAYER_NOT_PRESENT;
 
+#ifdef VK_EXT_layer_settings
+  // Applications may enable VK_EXT_layer_settings to configure the layer.
+  if (pProperties == nullptr) {
+    *pPropertyCount = 1;
+    return VK_SUCCESS;
+  }
+  if (*pPropertyCount < 1)
+    return VK_INCOMPLETE;
+  strcpy(pProperties[0].extensionName, VK_EXT_LAYER_SETTINGS_EXTENSION_NAME);
+  pProperties[0].specVersion = VK_EXT_LAYER_SETTINGS_SPEC_VERSION;
+  *pPropertyCount = 1;
+  return VK_SUCCESS;
+#else
   // don't expose any extensions
   if (pPropertyCount)
     *pPropertyCount = 0;
   return VK_SUCCESS;
+#endif
 }
 
 VkResult VKAPI_CALL lfx_EnumerateDeviceExtensionProperties(VkPhysicalDevice physicalDevice,
@@ -307,13 +1482,297 @@ VkResult VKAPI_CALL lfx_EnumerateDeviceExtensionProperties(VkPhysicalDevice phys
   return VK_SUCCESS;
 }
 
-VkResult VKAPI_CALL lfx_QueuePresentKHR(VkQueue queue, const VkPresentInfoKHR *pPresentInfo) {
-  frame_counter_render++;
-  uint64_t frame_counter_local = frame_counter.load();
-  uint64_t frame_counter_render_local = frame_counter_render.load();
-  if (frame_counter_local > frame_counter_render_local + kMaxFrameDrift) {
-    ticker_needs_reset.store(true);
+// Attribute the time spent in a pipeline compile to the frame it stalls, if it happened on a thread
+// on the critical path. Pipeline library links (VK_EXT_graphics_pipeline_library) also go through
+// vkCreateGraphicsPipelines.
+void RecordCompile(uint64_t begin) {
+  uint64_t duration = current_time_ns() - begin;
+  std::thread::id self = std::this_thread::get_id();
+  uint64_t frame_id;
+  if (self == present_thread.load(std::memory_order_relaxed))
+    frame_id = frame_counter_render.load() + 1;
+  else if (self == tick_thread.load(std::memory_order_relaxed))
+    frame_id = frame_counter.load();
+  else
+    return;
+  scoped_lock l(global_lock);
+  manager.AddCompileTime(frame_id, duration);
+}
+
+VkResult VKAPI_CALL lfx_CreateGraphicsPipelines(VkDevice device, VkPipelineCache pipelineCache,
+                                                uint32_t createInfoCount,
+                                                const VkGraphicsPipelineCreateInfo *pCreateInfos,
+                                                const VkAllocationCallbacks *pAllocator,
+                                                VkPipeline *pPipelines) {
+  PFN_vkCreateGraphicsPipelines next;
+  {
+    scoped_lock l(global_lock);
+    next = device_dispatch[GetKey(device)].CreateGraphicsPipelines;
+  }
+  uint64_t begin = current_time_ns();
+  VkResult ret = next(device, pipelineCache, createInfoCount, pCreateInfos, pAllocator, pPipelines);
+  RecordCompile(begin);
+  return ret;
+}
+
+VkResult VKAPI_CALL lfx_CreateComputePipelines(VkDevice device, VkPipelineCache pipelineCache,
+                                               uint32_t createInfoCount,
+                                               const VkComputePipelineCreateInfo *pCreateInfos,
+                                               const VkAllocationCallbacks *pAllocator,
+                                               VkPipeline *pPipelines) {
+  PFN_vkCreateComputePipelines next;
+  {
+    scoped_lock l(global_lock);
+    next = device_dispatch[GetKey(device)].CreateComputePipelines;
   }
+  uint64_t begin = current_time_ns();
+  VkResult ret = next(device, pipelineCache, createInfoCount, pCreateInfos, pAllocator, pPipelines);
+  RecordCompile(begin);
+  return ret;
+}
+
+// Account for the time the application spent waiting for the GPU, if it happened on the tick
+// thread. Engines that wait for the GPU to drain every frame already serialize CPU and GPU work;
+// see LatencyFleX::ReportSyncStall.
+void RecordSyncStall(uint64_t begin) {
+  if (std::this_thread::get_id() != tick_thread.load(std::memory_order_relaxed))
+    return;
+  uint64_t end = current_time_ns();
+  sync_stall_time += end - begin;
+  tick_blocked_time += end - begin;
+  sync_stall_end.store(end);
+}
+
+// Account for time the tick thread spent blocked in presentation, which is not idle time of the
+// game either.
+void RecordTickBlocked(uint64_t begin) {
+  if (std::this_thread::get_id() == tick_thread.load(std::memory_order_relaxed))
+    tick_blocked_time += current_time_ns() - begin;
+}
+
+VkResult VKAPI_CALL lfx_QueueWaitIdle(VkQueue queue) {
+  PFN_vkQueueWaitIdle next;
+  QueueTracker::Queue *tracked;
+  {
+    scoped_lock l(global_lock);
+    next = device_dispatch[GetKey(queue)].QueueWaitIdle;
+    tracked = FindTrackedQueue(queue);
+  }
+  uint64_t begin = current_time_ns();
+  VkResult ret;
+  if (tracked) {
+    // The layer submits to tracked queues from the present path.
+    scoped_lock queue_lock(tracked->lock);
+    ret = next(queue);
+  } else {
+    ret = next(queue);
+  }
+  RecordSyncStall(begin);
+  return ret;
+}
+
+VkResult VKAPI_CALL lfx_DeviceWaitIdle(VkDevice device) {
+  PFN_vkDeviceWaitIdle next;
+  {
+    scoped_lock l(global_lock);
+    next = device_dispatch[GetKey(device)].DeviceWaitIdle;
+  }
+  uint64_t begin = current_time_ns();
+  VkResult ret = next(device);
+  RecordSyncStall(begin);
+  return ret;
+}
+
+VkResult VKAPI_CALL lfx_WaitForFences(VkDevice device, uint32_t fenceCount, const VkFence *pFences,
+                                      VkBool32 waitAll, uint64_t timeout) {
+  PFN_vkWaitForFences next;
+  {
+    scoped_lock l(global_lock);
+    next = device_dispatch[GetKey(device)].WaitForFences;
+  }
+  uint64_t begin = current_time_ns();
+  VkResult ret = next(device, fenceCount, pFences, waitAll, timeout);
+  // Polls with a zero timeout never block.
+  if (timeout != 0)
+    RecordSyncStall(begin);
+  return ret;
+}
+
+// Get the GPU timer of the device of `queue` if it is the presenting queue, creating it on the
+// first present. Must be called with global_lock held.
+GpuTimer *GetGpuTimer(VkQueue queue, bool create = true) {
+  auto it = gpu_timing.find(GetKey(queue));
+  if (it == gpu_timing.end())
+    return nullptr;
+  GpuTiming &timing = it->second;
+  if (timing.timer)
+    return timing.timer->Queue() == queue ? timing.timer.get() : nullptr;
+  if (!create || timing.failed)
+    return nullptr;
+  timing.failed = true;
+  auto family = queue_families.find(queue);
+  if (family == queue_families.end() || family->second >= timing.valid_bits.size() ||
+      timing.valid_bits[family->second] == 0) {
+    std::cerr << "LatencyFleX: Timestamps not supported on the presenting queue" << std::endl;
+    return nullptr;
+  }
+  auto timer = std::make_unique<GpuTimer>(device_map[GetKey(queue)], device_dispatch[GetKey(queue)],
+                                          timing.set_loader_data, queue, family->second,
+                                          timing.valid_bits[family->second], timing.period);
+  if (!timer->Ok()) {
+    std::cerr << "LatencyFleX: Failed to set up GPU timestamps" << std::endl;
+    return nullptr;
+  }
+  timing.failed = false;
+  timing.timer = std::move(timer);
+  return timing.timer.get();
+}
+
+// Whether the timestamp command buffer can be added to a batch. Device group batches have a device
+// mask per command buffer, and protected batches only take protected command buffers.
+bool CanAddCommandBuffer(const VkSubmitInfo &submit) {
+  for (auto *ext = (const VkBaseInStructure *)submit.pNext; ext; ext = ext->pNext) {
+    if (ext->sType == VK_STRUCTURE_TYPE_DEVICE_GROUP_SUBMIT_INFO ||
+        (ext->sType == VK_STRUCTURE_TYPE_PROTECTED_SUBMIT_INFO &&
+         ((const VkProtectedSubmitInfo *)ext)->protectedSubmit))
+      return false;
+  }
+  return true;
+}
+
+bool CanAddCommandBuffer(const VkSubmitInfo2 &submit) {
+  return !(submit.flags & VK_SUBMIT_PROTECTED_BIT);
+}
+
+// Get the command buffer writing the start timestamp of the next frame, if this is its first
+// submission to the presenting queue. Batches that cannot take it leave the frame to the next
+// submission.
+template <typename SubmitInfo>
+VkCommandBuffer GetFrameBeginCmd(VkQueue queue, uint32_t submitCount, const SubmitInfo *pSubmits) {
+  if (submitCount == 0 || !CanAddCommandBuffer(pSubmits[0]))
+    return VK_NULL_HANDLE;
+  GpuTimer *timer = GetGpuTimer(queue, false);
+  return timer ? timer->BeginFrame(frame_counter_render.load() + 1) : VK_NULL_HANDLE;
+}
+
+void VKAPI_CALL lfx_GetDeviceQueue(VkDevice device, uint32_t queueFamilyIndex, uint32_t queueIndex,
+                                   VkQueue *pQueue) {
+  PFN_vkGetDeviceQueue next;
+  {
+    scoped_lock l(global_lock);
+    next = device_dispatch[GetKey(device)].GetDeviceQueue;
+  }
+  next(device, queueFamilyIndex, queueIndex, pQueue);
+  scoped_lock l(global_lock);
+  queue_families[*pQueue] = queueFamilyIndex;
+}
+
+void VKAPI_CALL lfx_GetDeviceQueue2(VkDevice device, const VkDeviceQueueInfo2 *pQueueInfo,
+                                    VkQueue *pQueue) {
+  PFN_vkGetDeviceQueue2 next;
+  {
+    scoped_lock l(global_lock);
+    next = device_dispatch[GetKey(device)].GetDeviceQueue2;
+  }
+  next(device, pQueueInfo, pQueue);
+  scoped_lock l(global_lock);
+  queue_families[*pQueue] = pQueueInfo->queueFamilyIndex;
+}
+
+// Forward a submission, and mark `tracked` from FindTrackedQueue() as having pending work.
+template <typename SubmitInfo>
+VkResult SubmitTracked(VkResult (*next)(VkQueue, uint32_t, const SubmitInfo *, VkFence),
+                       VkQueue queue, uint32_t submitCount, const SubmitInfo *pSubmits,
+                       VkFence fence, QueueTracker::Queue *tracked) {
+  if (!tracked)
+    return next(queue, submitCount, pSubmits, fence);
+  scoped_lock l(tracked->lock);
+  VkResult ret = next(queue, submitCount, pSubmits, fence);
+  if (ret == VK_SUCCESS)
+    tracked->pending = true;
+  return ret;
+}
+
+VkResult VKAPI_CALL lfx_QueueSubmit(VkQueue queue, uint32_t submitCount,
+                                    const VkSubmitInfo *pSubmits, VkFence fence) {
+  uint64_t call_begin = CallStatsBegin();
+  PFN_vkQueueSubmit next;
+  VkCommandBuffer begin_cmd;
+  QueueTracker::Queue *tracked;
+  {
+    scoped_lock l(global_lock);
+    next = device_dispatch[GetKey(queue)].QueueSubmit;
+    begin_cmd = GetFrameBeginCmd(queue, submitCount, pSubmits);
+    tracked = FindTrackedQueue(queue);
+  }
+  if (begin_cmd == VK_NULL_HANDLE) {
+    RecordCallOverhead(kCallSubmit, call_begin);
+    return SubmitTracked(next, queue, submitCount, pSubmits, fence, tracked);
+  }
+
+  // Run the timestamp as part of the first batch, so that it comes after its semaphore waits.
+  std::vector<VkSubmitInfo> submits(pSubmits, pSubmits + submitCount);
+  std::vector<VkCommandBuffer> cmds{begin_cmd};
+  cmds.insert(cmds.end(), pSubmits[0].pCommandBuffers,
+              pSubmits[0].pCommandBuffers + pSubmits[0].commandBufferCount);
+  submits[0].commandBufferCount = cmds.size();
+  submits[0].pCommandBuffers = cmds.data();
+  RecordCallOverhead(kCallSubmit, call_begin);
+  return SubmitTracked(next, queue, submitCount, submits.data(), fence, tracked);
+}
+
+VkResult QueueSubmit2Common(uint64_t call_begin, PFN_vkQueueSubmit2 next, VkQueue queue,
+                            uint32_t submitCount, const VkSubmitInfo2 *pSubmits, VkFence fence) {
+  VkCommandBuffer begin_cmd;
+  QueueTracker::Queue *tracked;
+  {
+    scoped_lock l(global_lock);
+    begin_cmd = GetFrameBeginCmd(queue, submitCount, pSubmits);
+    tracked = FindTrackedQueue(queue);
+  }
+  if (begin_cmd == VK_NULL_HANDLE) {
+    RecordCallOverhead(kCallSubmit, call_begin);
+    return SubmitTracked(next, queue, submitCount, pSubmits, fence, tracked);
+  }
+
+  std::vector<VkSubmitInfo2> submits(pSubmits, pSubmits + submitCount);
+  VkCommandBufferSubmitInfo begin_info{};
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO;
+  begin_info.commandBuffer = begin_cmd;
+  std::vector<VkCommandBufferSubmitInfo> cmds{begin_info};
+  cmds.insert(cmds.end(), pSubmits[0].pCommandBufferInfos,
+              pSubmits[0].pCommandBufferInfos + pSubmits[0].commandBufferInfoCount);
+  submits[0].commandBufferInfoCount = cmds.size();
+  submits[0].pCommandBufferInfos = cmds.data();
+  RecordCallOverhead(kCallSubmit, call_begin);
+  return SubmitTracked(next, queue, submitCount, submits.data(), fence, tracked);
+}
+
+VkResult VKAPI_CALL lfx_QueueSubmit2(VkQueue queue, uint32_t submitCount,
+                                     const VkSubmitInfo2 *pSubmits, VkFence fence) {
+  uint64_t call_begin = CallStatsBegin();
+  PFN_vkQueueSubmit2 next;
+  {
+    scoped_lock l(global_lock);
+    next = device_dispatch[GetKey(queue)].QueueSubmit2;
+  }
+  return QueueSubmit2Common(call_begin, next, queue, submitCount, pSubmits, fence);
+}
+
+VkResult VKAPI_CALL lfx_QueueSubmit2KHR(VkQueue queue, uint32_t submitCount,
+                                        const VkSubmitInfo2 *pSubmits, VkFence fence) {
+  uint64_t call_begin = CallStatsBegin();
+  PFN_vkQueueSubmit2KHR next;
+  {
+    scoped_lock l(global_lock);
+    next = device_dispatch[GetKey(queue)].QueueSubmit2KHR;
+  }
+  return QueueSubmit2Common(call_begin, next, queue, submitCount, pSubmits, fence);
+}
+
+VkResult VKAPI_CALL lfx_QueuePresentKHR(VkQueue queue, const VkPresentInfoKHR *pPresentInfo) {
+  uint64_t call_begin = CallStatsBegin();
+  uint64_t frame_counter_render_local = BeginPresent();
 
   std::unique_lock<std::mutex> l(global_lock);
   VkDevice device = device_map[GetKey(queue)];
@@ -331,20 +1790,56 @@ VkResult VKAPI_CALL lfx_QueuePresentKHR(VkQueue queue, const VkPresentInfoKHR *p
   submitInfo.pWaitDstStageMask = &stages_wait;
   submitInfo.signalSemaphoreCount = pPresentInfo->waitSemaphoreCount;
   submitInfo.pSignalSemaphores = pPresentInfo->pWaitSemaphores;
+  VkCommandBuffer timestamp_cmd = VK_NULL_HANDLE;
+  if (GpuTimer *timer = GetGpuTimer(queue))
+    timestamp_cmd = timer->EndFrame(frame_counter_render_local);
+  if (timestamp_cmd != VK_NULL_HANDLE) {
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &timestamp_cmd;
+  }
   dispatch.QueueSubmit(queue, 1, &submitInfo, fence);
-  wait_threads[GetKey(device)]->Push({device, fence, frame_counter_render_local});
+  std::vector<VkFence> queue_fences;
+  auto tracker = queue_trackers.find(GetKey(queue));
+  if (tracker != queue_trackers.end())
+    queue_fences = tracker->second->Present(queue);
+  size_t queued = wait_threads[GetKey(device)]->Push(
+      {device, fence, frame_counter_render_local, std::move(queue_fences)});
+  RecordCompletion(&completion_queue_depth, queued);
+  // The hold comes after the completion fence has been submitted, so that it only delays
+  // presentation and not the latency measurement.
+  uint64_t begin = current_time_ns();
+  bool pacing = present_pacer.max_hold != 0;
+  uint64_t hold = present_pacer.Schedule(begin, std::max(manager.GetFrameTime(),
+                                                         (double)manager.target_frame_time));
   l.unlock();
-  return dispatch.QueuePresentKHR(queue, pPresentInfo);
+  uint64_t held = 0;
+  if (pacing) {
+    if (hold != 0)
+      std::this_thread::sleep_for(std::chrono::nanoseconds(hold));
+    held = current_time_ns() - begin;
+    l.lock();
+    present_pacer.Release(begin, begin + held);
+    l.unlock();
+    last_present_hold.store(hold);
+  }
+  RecordCallOverhead(kCallPresent, call_begin, held);
+  VkResult res = dispatch.QueuePresentKHR(queue, pPresentInfo);
+  RecordTickBlocked(begin);
+  return res;
 }
 
 VkResult VKAPI_CALL lfx_AcquireNextImageKHR(VkDevice device, VkSwapchainKHR swapchain,
                                             uint64_t timeout, VkSemaphore semaphore, VkFence fence,
                                             uint32_t *pImageIndex) {
+  uint64_t call_begin = CallStatsBegin();
   std::unique_lock<std::mutex> l(global_lock);
   VkLayerDispatchTable &dispatch = device_dispatch[GetKey(device)];
   l.unlock();
+  RecordCallOverhead(kCallAcquire, call_begin);
+  uint64_t begin = current_time_ns();
   VkResult res =
       dispatch.AcquireNextImageKHR(device, swapchain, timeout, semaphore, fence, pImageIndex);
+  RecordTickBlocked(begin);
   if (res < 0) {
     // An error has occurred likely due to an Alt-Tab or resize.
     // The application will likely give up presenting this frame, which means that we won't get a
@@ -358,10 +1853,14 @@ VkResult VKAPI_CALL lfx_AcquireNextImageKHR(VkDevice device, VkSwapchainKHR swap
 VkResult VKAPI_CALL lfx_AcquireNextImage2KHR(VkDevice device,
                                              const VkAcquireNextImageInfoKHR *pAcquireInfo,
                                              uint32_t *pImageIndex) {
+  uint64_t call_begin = CallStatsBegin();
   std::unique_lock<std::mutex> l(global_lock);
   VkLayerDispatchTable &dispatch = device_dispatch[GetKey(device)];
   l.unlock();
+  RecordCallOverhead(kCallAcquire, call_begin);
+  uint64_t begin = current_time_ns();
   VkResult res = dispatch.AcquireNextImage2KHR(device, pAcquireInfo, pImageIndex);
+  RecordTickBlocked(begin);
   if (res < 0) {
     // An error has occurred likely due to an Alt-Tab or resize.
     // The application will likely give up presenting this frame, which means that we won't get a
@@ -390,11 +1889,26 @@ extern "C" VK_LAYER_EXPORT PFN_vkVoidFunction VKAPI_CALL lfx_GetDeviceProcAddr(V
   GETPROCADDR(QueuePresentKHR);
   GETPROCADDR(AcquireNextImageKHR);
   GETPROCADDR(AcquireNextImage2KHR);
-
+  GETPROCADDR(CreateGraphicsPipelines);
+  GETPROCADDR(CreateComputePipelines);
+  GETPROCADDR(QueueWaitIdle);
+  GETPROCADDR(DeviceWaitIdle);
+  GETPROCADDR(WaitForFences);
+  GETPROCADDR(GetDeviceQueue);
+  GETPROCADDR(GetDeviceQueue2);
+  GETPROCADDR(QueueSubmit);
+
+  PFN_vkVoidFunction next;
   {
     scoped_lock l(global_lock);
-    return device_dispatch[GetKey(device)].GetDeviceProcAddr(device, pName);
+    next = device_dispatch[GetKey(device)].GetDeviceProcAddr(device, pName);
+  }
+  // Applications check these for null to tell whether they are supported.
+  if (next) {
+    GETPROCADDR(QueueSubmit2);
+    GETPROCADDR(QueueSubmit2KHR);
   }
+  return next;
 }
 
 extern "C" VK_LAYER_EXPORT PFN_vkVoidFunction VKAPI_CALL
@@ -415,6 +1929,16 @@ lfx_GetInstanceProcAddr(VkInstance instance, const char *pName) {
   GETPROCADDR(QueuePresentKHR);
   GETPROCADDR(AcquireNextImageKHR);
   GETPROCADDR(AcquireNextImage2KHR);
+  GETPROCADDR(CreateGraphicsPipelines);
+  GETPROCADDR(CreateComputePipelines);
+  GETPROCADDR(QueueWaitIdle);
+  GETPROCADDR(DeviceWaitIdle);
+  GETPROCADDR(WaitForFences);
+  GETPROCADDR(GetDeviceQueue);
+  GETPROCADDR(GetDeviceQueue2);
+  GETPROCADDR(QueueSubmit);
+  GETPROCADDR(QueueSubmit2);
+  GETPROCADDR(QueueSubmit2KHR);
 
   {
     scoped_lock l(global_lock);
@@ -422,7 +1946,24 @@ lfx_GetInstanceProcAddr(VkInstance instance, const char *pName) {
   }
 }
 
+// Apply a cap returned by EngineLimiterDetector. A cap set by the user always takes precedence.
+void SetEngineLimiterCap(uint64_t cap) {
+  scoped_lock l(global_lock);
+  if (manager.target_frame_time != engine_limiter_cap) {
+    // Set by the user in the meantime.
+    engine_limiter_cap = 0;
+    if (cap != 0)
+      engine_limiter.Disable();
+    return;
+  }
+  manager.target_frame_time = cap;
+  engine_limiter_cap = cap;
+  std::cerr << "LatencyFleX: setting target frame time to " << manager.target_frame_time
+            << std::endl;
+}
+
 extern "C" VK_LAYER_EXPORT void lfx_WaitAndBeginFrame() {
+  tick_thread.store(std::this_thread::get_id(), std::memory_order_relaxed);
   frame_counter++;
   uint64_t frame_counter_local = frame_counter.load();
   uint64_t frame_counter_render_local = frame_counter_render.load();
@@ -436,6 +1977,7 @@ extern "C" VK_LAYER_EXPORT void lfx_WaitAndBeginFrame() {
 
   if (ticker_needs_reset.load()) {
     std::cerr << "LatencyFleX: Performing recalibration!" << std::endl;
+    recalibrations++;
     // Try to reset (recalibrate) the state by sleeping for a slightly long
     // period and force any work in the rendering thread or the RHI thread to be
     // flushed. The frame counter is reset after the calibration.
@@ -446,23 +1988,73 @@ extern "C" VK_LAYER_EXPORT void lfx_WaitAndBeginFrame() {
     frame_counter_local = 1;
     frame_counter_render.store(0);
     frame_counter_render_local = 0;
+    frame_counter_render_thread.store(0);
     ticker_needs_reset.store(false);
+    engine_limiter.ResetWindow();
+    prev_tick_ts = 0;
+    frame_cadence.Reset();
     scoped_lock l(global_lock);
     manager.Reset();
   }
   uint64_t now = current_time_ns();
+  uint64_t now_cpu = current_thread_cpu_time_ns();
+  // Idle time only points to a limiter if the tick thread also presents. Otherwise it is usually
+  // spent waiting for the rendering thread, which the layer cannot tell apart from a sleep.
+  if (prev_tick_ts != 0 && engine_limiter_enabled.load() && !is_placebo_mode &&
+      present_thread.load(std::memory_order_relaxed) == std::this_thread::get_id()) {
+    uint64_t app_time = now - prev_tick_end_ts;
+    uint64_t busy = (now_cpu - prev_tick_end_cpu) + tick_blocked_time.load();
+    std::optional<uint64_t> cap =
+        engine_limiter.Update(now - prev_tick_ts, app_time > busy ? app_time - busy : 0,
+                              frame_counter_render_local - prev_tick_presents);
+    if (cap)
+      SetEngineLimiterCap(*cap);
+  }
+  tick_blocked_time.store(0);
+  if (sched_stats_enabled.load()) {
+    static thread_local pid_t tid = syscall(SYS_gettid);
+    tick_contention.Update(tid, "Run Queue Delay", "Preemptions");
+    completion_contention.Update(completion_tid.load(), "Completion Run Queue Delay",
+                                 "Completion Preemptions");
+  }
+  prev_tick_ts = now;
+  prev_tick_presents = frame_counter_render_local;
   uint64_t target;
   uint64_t wakeup;
+  // With coordination, the wake-up target moves so that the GPU work of the frame interleaves with
+  // that of other instances. The target given to BeginFrame stays the same, so the shift counts
+  // as a correction of the schedule rather than as queuing.
+  uint64_t wake_target;
+  uint64_t gpu_delay = 0;
+  uint64_t gpu_busy = 0;
+  uint64_t frame_interval = 0;
   {
     scoped_lock l(global_lock);
+    manager.ReportSyncStall(sync_stall_time.exchange(0), sync_stall_end.load());
     target = manager.GetWaitTarget(frame_counter_local);
+    wake_target = target;
+    if (coordination.is_open() && target != 0) {
+      gpu_busy = std::round(manager.GetGpuTime());
+      // Without a render submit stage, the GPU work is assumed to start when the frame is
+      // presented.
+      double submit = manager.GetStageLatency(lfx::kRenderSubmit);
+      gpu_delay = std::round(submit > 0 ? submit : frame_cadence.GetSubmitDelay());
+      frame_interval =
+          std::round(std::max(frame_cadence.GetInterval(), manager.GetFrameTime()));
+      // A target in the past means that the frame begins right away.
+      uint64_t begin = std::max(target, now);
+      int64_t shift = coordination.Interleave(begin + gpu_delay, gpu_busy,
+                                              std::round(kMaxInterleaveRatio * frame_interval));
+      wake_target = begin + shift;
+      last_interleave_shift.store(shift);
+    }
   }
-  if (!is_placebo_mode && target > now) {
+  if (!is_placebo_mode && wake_target > now) {
     // failsafe: if something ever goes wrong, sustain an interactive framerate
     // so the user can at least quit the application
     static uint64_t failsafe_triggered = 0;
     uint64_t failsafe = now + UINT64_C(50000000);
-    if (target > failsafe) {
+    if (wake_target > failsafe) {
       wakeup = failsafe;
       failsafe_triggered++;
       if (failsafe_triggered > 5) {
@@ -470,7 +2062,7 @@ extern "C" VK_LAYER_EXPORT void lfx_WaitAndBeginFrame() {
         ticker_needs_reset.store(true);
       }
     } else {
-      wakeup = target;
+      wakeup = wake_target;
       failsafe_triggered = 0;
     }
     std::this_thread::sleep_for(std::chrono::nanoseconds(wakeup - now));
@@ -481,7 +2073,13 @@ extern "C" VK_LAYER_EXPORT void lfx_WaitAndBeginFrame() {
     scoped_lock l(global_lock);
     // Use the sleep target as the frame begin time. See `BeginFrame` docs.
     manager.BeginFrame(frame_counter_local, target, wakeup);
+    if (coordination.is_open() && gpu_busy != 0)
+      coordination.Publish(wakeup + gpu_delay, gpu_busy, frame_interval);
   }
+  if (coordination_enabled.load(std::memory_order_relaxed))
+    frame_cadence.Begin(frame_counter_local, wakeup);
+  prev_tick_end_ts = current_time_ns();
+  prev_tick_end_cpu = current_thread_cpu_time_ns();
 }
 
 extern "C" VK_LAYER_EXPORT void lfx_SetTargetFrameTime(uint64_t target_frame_time) {
@@ -491,22 +2089,100 @@ extern "C" VK_LAYER_EXPORT void lfx_SetTargetFrameTime(uint64_t target_frame_tim
             << std::endl;
 }
 
+extern "C" VK_LAYER_EXPORT void lfx_MarkStage(uint32_t stage) {
+  if (stage >= lfx::kNumStages)
+    return;
+  uint64_t now = current_time_ns();
+  uint64_t frame_id;
+  if (stage == lfx::kRenderBegin) {
+    // The rendering thread works through the ticks in order, one frame each. With a separate RHI
+    // thread it runs a frame ahead of presentation, so the next frame to be presented would be the
+    // wrong one. It cannot be ahead of the game thread or behind presentation, though.
+    uint64_t next = frame_counter_render_thread.load() + 1;
+    frame_id = std::max(std::min(next, frame_counter.load()), frame_counter_render.load() + 1);
+    frame_counter_render_thread.store(frame_id);
+  } else if (stage == lfx::kRenderEnd && frame_counter_render_thread.load() != 0) {
+    frame_id = frame_counter_render_thread.load();
+  } else if (stage == lfx::kRenderSubmit || stage == lfx::kRenderEnd) {
+    frame_id = frame_counter_render.load() + 1;
+  } else {
+    frame_id = frame_counter.load();
+  }
+  scoped_lock l(global_lock);
+  manager.MarkStage(frame_id, static_cast<lfx::Stages>(stage), now);
+}
+
+extern "C" VK_LAYER_EXPORT uint64_t lfx_GetSubmitDeadline() {
+  // Render stages belong to the next frame to be presented, see lfx_MarkStage.
+  uint64_t frame_id = frame_counter_render.load() + 1;
+  scoped_lock l(global_lock);
+  return manager.GetSubmitDeadline(frame_id);
+}
+
+extern "C" VK_LAYER_EXPORT uint64_t lfx_BeginPresent() { return BeginPresent(); }
+
+extern "C" VK_LAYER_EXPORT void lfx_EndFrame(uint64_t frame_id, uint64_t timestamp) {
+  CompleteFrame(frame_id, timestamp != 0 ? timestamp : current_time_ns());
+}
+
+namespace {
+// Hand a frame ended by the application to the wait thread of `device`, or of the only device if
+// null. Returns the frame ID, or 0 if the device is not known.
+uint64_t EndFrameOn(void *device, PresentInfo &&info) {
+  scoped_lock l(global_lock);
+  auto it = device ? device_map.find(GetKey((VkDevice)device)) : device_map.begin();
+  if (it == device_map.end() || (!device && device_map.size() != 1)) {
+    // Logged once: the application likely makes the same call every frame.
+    static bool logged = false;
+    if (!logged)
+      std::cerr << "LatencyFleX: Cannot end frame on unknown device " << device << std::endl;
+    logged = true;
+    return 0;
+  }
+  const VkLayerDispatchTable &dispatch = device_dispatch[it->first];
+  if (info.semaphore != VK_NULL_HANDLE && !dispatch.WaitSemaphores && !dispatch.WaitSemaphoresKHR) {
+    std::cerr << "LatencyFleX: Cannot end frame on a semaphore without timeline semaphores"
+              << std::endl;
+    return 0;
+  }
+  uint64_t frame_id = BeginPresent();
+  info.device = it->second;
+  info.frame_id = frame_id;
+  size_t queued = wait_threads[it->first]->Push(std::move(info));
+  RecordCompletion(&completion_queue_depth, queued);
+  return frame_id;
+}
+} // namespace
+
+extern "C" VK_LAYER_EXPORT uint64_t lfx_EndFrameOnFence(void *device, uint64_t fence) {
+  PresentInfo info{};
+  info.fence = (VkFence)fence;
+  info.app_fence = true;
+  return EndFrameOn(device, std::move(info));
+}
+
+extern "C" VK_LAYER_EXPORT uint64_t lfx_EndFrameOnSemaphore(void *device, uint64_t semaphore,
+                                                            uint64_t value) {
+  PresentInfo info{};
+  info.semaphore = (VkSemaphore)semaphore;
+  info.semaphore_value = value;
+  return EndFrameOn(device, std::move(info));
+}
+
+extern "C" VK_LAYER_EXPORT uint64_t lfx_GetPresentCount() { return frame_counter_render.load(); }
+
+extern "C" VK_LAYER_EXPORT bool lfx_GetConfigBool(const char *key) {
+  return lfx::config::GetBool(key);
+}
+
 namespace {
 class OnLoad {
 public:
   OnLoad() {
     std::cerr << "LatencyFleX: module loaded" << std::endl;
     std::cerr << "LatencyFleX: Version " LATENCYFLEX_VERSION << std::endl;
-    if (getenv("LFX_MAX_FPS")) {
-      // No lock needed because this is done inside static initialization.
-      manager.target_frame_time = 1000000000 / std::stoul(getenv("LFX_MAX_FPS"));
-      std::cerr << "LatencyFleX: setting target frame time to " << manager.target_frame_time
-                << std::endl;
-    }
-    if (getenv("LFX_PLACEBO")) {
-      is_placebo_mode = true;
-      std::cerr << "LatencyFleX: Running in placebo mode" << std::endl;
-    }
+    ApplyConfig();
+    lfx::config::Watch(ApplyConfig);
   }
 };
 
@@ -32,6 +32,60 @@
 extern "C" VK_LAYER_EXPORT void lfx_WaitAndBeginFrame();
 extern "C" VK_LAYER_EXPORT void lfx_SetTargetFrameTime(uint64_t target_frame_time);
 
+// Values for lfx_MarkStage. Keep in sync with lfx::Stages.
+enum : uint32_t {
+  LFX_STAGE_INPUT_SAMPLE = 0,
+  LFX_STAGE_SIMULATION_END = 1,
+  LFX_STAGE_RENDER_SUBMIT = 2,
+  LFX_STAGE_RENDER_BEGIN = 3,
+  LFX_STAGE_RENDER_END = 4,
+};
+
+// Report that the current frame reached a pipeline stage. Simulation stages are attributed to the
+// frame last started with lfx_WaitAndBeginFrame, and render submission to the next frame to be
+// presented. Each render begin moves on to the next frame started with lfx_WaitAndBeginFrame, and
+// render end belongs to the same frame as the last render begin.
+extern "C" VK_LAYER_EXPORT void lfx_MarkStage(uint32_t stage);
+
+// Frame accounting for presentation paths other than the Vulkan layer, such as the OpenGL preload
+// module or a pipeline handing frames to a video encoder. lfx_BeginPresent is called when a frame
+// is submitted for presentation and returns the ID of the frame. lfx_EndFrame is called with that
+// ID once the frame's rendering work has completed. `timestamp` must be in the clock domain of
+// current_time_ns(), or 0 for the current time.
+extern "C" VK_LAYER_EXPORT uint64_t lfx_BeginPresent();
+extern "C" VK_LAYER_EXPORT void lfx_EndFrame(uint64_t frame_id, uint64_t timestamp);
+
+// Frame accounting for Vulkan pipelines without a swapchain, such as rendering offscreen for a
+// video encoder. Like lfx_BeginPresent, these account for a frame submitted for presentation and
+// return its ID. The frame then completes once `fence` signals, or once `semaphore`, a timeline
+// semaphore, reaches `value`. The fence must not be reset or destroyed before it has signaled. A
+// frame whose fence or semaphore is not signaled within a second is dropped.
+//
+// `device` is the VkDevice and `fence` and `semaphore` the VkFence and VkSemaphore, passed as plain
+// types so that this header does not need the Vulkan headers. `device` may be null if the
+// application has a single device. The Wine bridge always passes null, as the application's
+// handle is not the one the layer sees, so it only supports applications with a single device.
+// Returns 0 if the device is not known to the layer.
+extern "C" VK_LAYER_EXPORT uint64_t lfx_EndFrameOnFence(void *device, uint64_t fence);
+extern "C" VK_LAYER_EXPORT uint64_t lfx_EndFrameOnSemaphore(void *device, uint64_t semaphore,
+                                                            uint64_t value);
+
+// Latest time the render submit of the next frame to be presented can happen without delaying its
+// completion, for engines that sample input or the camera again right before submitting ("late
+// latching"). Work submitted earlier only waits in the queue. In the clock domain of
+// current_time_ns(), or 0 if not known yet. This is an estimate: leave a margin for the submission
+// itself. Needs GPU timing or the render submit stage, see lfx::LatencyFleX::GetSubmitDeadline.
+extern "C" VK_LAYER_EXPORT uint64_t lfx_GetSubmitDeadline();
+
+// Number of frames presented so far, through any presentation path. Tick sources without a
+// well-defined frame boundary use this to tell whether a new frame has started. The value is reset
+// when the ticker is recalibrated, so only compare it for equality.
+extern "C" VK_LAYER_EXPORT uint64_t lfx_GetPresentCount();
+
+// Look up a boolean setting with lfx::config::GetBool, for the preload module, which shares the
+// layer's configuration but not its internal symbols.
+extern "C" VK_LAYER_EXPORT bool lfx_GetConfigBool(const char *key);
+
 inline uint64_t current_time_ns() {
   struct timespec tv;
   // CLOCK_BOOTTIME used for compatibility with Perfetto timestamps
@@ -39,4 +93,11 @@ inline uint64_t current_time_ns() {
   return tv.tv_nsec + tv.tv_sec * UINT64_C(1000000000);
 }
 
+// CPU time consumed by the calling thread.
+inline uint64_t current_thread_cpu_time_ns() {
+  struct timespec tv;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &tv);
+  return tv.tv_nsec + tv.tv_sec * UINT64_C(1000000000);
+}
+
 #endif // LATENCYFLEX_LATENCYFLEX_LAYER_H
@@ -0,0 +1,384 @@
+// Copyright 2022 Tatsuyuki Ishi
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "latencyflex_sigscan.h"
+#include "latencyflex_config.h"
+#include "latencyflex_layer.h"
+
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <elf.h>
+#include <link.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LATENCYFLEX_SIGSCAN_X86
+#endif
+
+#ifndef LATENCYFLEX_DATADIR
+#define LATENCYFLEX_DATADIR "/usr/share"
+#endif
+
+namespace lfx {
+namespace sigscan {
+namespace {
+struct Signature {
+  std::string name;
+  std::string engine;
+  int64_t offset;
+  Pattern pattern;
+};
+
+struct Database {
+  uint32_t version = 0;
+  std::vector<Signature> signatures;
+};
+
+struct Segment {
+  const uint8_t *begin;
+  const uint8_t *end;
+};
+
+struct Module {
+  uintptr_t base = 0;
+  std::string build_id;
+  std::vector<Segment> segments;
+  bool found = false;
+};
+
+bool Matches(const Pattern &pattern, const uint8_t *p) {
+  for (size_t i = 0; i < pattern.bytes.size(); i++) {
+    if ((p[i] & pattern.mask[i]) != pattern.bytes[i])
+      return false;
+  }
+  return true;
+}
+
+const uint8_t *FindScalar(const Pattern &pattern, const uint8_t *begin, const uint8_t *end) {
+  size_t len = pattern.bytes.size();
+  if ((size_t)(end - begin) < len)
+    return nullptr;
+  const uint8_t *limit = end - len;
+  const uint8_t *cur = begin;
+  while (cur <= limit) {
+    const void *hit = memchr(cur + pattern.first, pattern.bytes[pattern.first],
+                             limit - cur + 1);
+    if (!hit)
+      return nullptr;
+    cur = (const uint8_t *)hit - pattern.first;
+    if (Matches(pattern, cur))
+      return cur;
+    cur++;
+  }
+  return nullptr;
+}
+
+#ifdef LATENCYFLEX_SIGSCAN_X86
+// Both vectorized variants compare the first and the last non-wildcard byte of the pattern against
+// a whole vector of candidate positions at once, and only verify the full pattern on positions
+// where both bytes match. Using two bytes that are far apart filters out most false candidates even
+// for common opcode bytes like 0x48.
+__attribute__((target("avx2"))) const uint8_t *FindAvx2(const Pattern &pattern,
+                                                         const uint8_t *begin,
+                                                         const uint8_t *end) {
+  size_t len = pattern.bytes.size();
+  if ((size_t)(end - begin) < len)
+    return nullptr;
+  const uint8_t *limit = end - len;
+  const __m256i first = _mm256_set1_epi8((char)pattern.bytes[pattern.first]);
+  const __m256i last = _mm256_set1_epi8((char)pattern.bytes[pattern.last]);
+  const uint8_t *cur = begin;
+  for (; limit - cur >= 31; cur += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(cur + pattern.first));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(cur + pattern.last));
+    uint32_t bits = (uint32_t)_mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+    while (bits) {
+      const uint8_t *candidate = cur + __builtin_ctz(bits);
+      if (Matches(pattern, candidate))
+        return candidate;
+      bits &= bits - 1;
+    }
+  }
+  return FindScalar(pattern, cur, end);
+}
+
+const uint8_t *FindSse2(const Pattern &pattern, const uint8_t *begin, const uint8_t *end) {
+  size_t len = pattern.bytes.size();
+  if ((size_t)(end - begin) < len)
+    return nullptr;
+  const uint8_t *limit = end - len;
+  const __m128i first = _mm_set1_epi8((char)pattern.bytes[pattern.first]);
+  const __m128i last = _mm_set1_epi8((char)pattern.bytes[pattern.last]);
+  const uint8_t *cur = begin;
+  for (; limit - cur >= 15; cur += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(cur + pattern.first));
+    __m128i b = _mm_loadu_si128((const __m128i *)(cur + pattern.last));
+    uint32_t bits = (uint32_t)_mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (bits) {
+      const uint8_t *candidate = cur + __builtin_ctz(bits);
+      if (Matches(pattern, candidate))
+        return candidate;
+      bits &= bits - 1;
+    }
+  }
+  return FindScalar(pattern, cur, end);
+}
+#endif
+
+bool ModuleNameMatches(const char *path, const std::string &module) {
+  if (module.empty())
+    return false;
+  const char *basename = strrchr(path, '/');
+  basename = basename ? basename + 1 : path;
+  return strcmp(basename, module.c_str()) == 0 || strstr(path, module.c_str()) != nullptr;
+}
+
+int CollectModule(struct dl_phdr_info *info, size_t, void *data) {
+  auto *target = static_cast<std::pair<const std::string *, Module *> *>(data);
+  const std::string &name = *target->first;
+  Module &module = *target->second;
+  // The main executable is always the first object reported, with an empty name.
+  bool is_main = info->dlpi_name == nullptr || info->dlpi_name[0] == '\0';
+  if (name.empty() ? !is_main : !ModuleNameMatches(info->dlpi_name, name))
+    return 0;
+
+  module.found = true;
+  module.base = info->dlpi_addr;
+  for (int i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr) &phdr = info->dlpi_phdr[i];
+    if (phdr.p_type == PT_LOAD && (phdr.p_flags & PF_X) && (phdr.p_flags & PF_R)) {
+      const uint8_t *begin = (const uint8_t *)(info->dlpi_addr + phdr.p_vaddr);
+      module.segments.push_back({begin, begin + phdr.p_memsz});
+    } else if (phdr.p_type == PT_NOTE && module.build_id.empty()) {
+      const uint8_t *note = (const uint8_t *)(info->dlpi_addr + phdr.p_vaddr);
+      const uint8_t *note_end = note + phdr.p_memsz;
+      while (note + sizeof(ElfW(Nhdr)) <= note_end) {
+        const ElfW(Nhdr) *nhdr = (const ElfW(Nhdr) *)note;
+        const uint8_t *desc = note + sizeof(ElfW(Nhdr)) + ((nhdr->n_namesz + 3) & ~3u);
+        if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+            memcmp(note + sizeof(ElfW(Nhdr)), "GNU", 4) == 0) {
+          static const char kHex[] = "0123456789abcdef";
+          for (uint32_t j = 0; j < nhdr->n_descsz; j++) {
+            module.build_id += kHex[desc[j] >> 4];
+            module.build_id += kHex[desc[j] & 0xf];
+          }
+          break;
+        }
+        note = desc + ((nhdr->n_descsz + 3) & ~3u);
+      }
+    }
+  }
+  return 1;
+}
+
+Module LoadModule(const std::string &name) {
+  Module module;
+  std::pair<const std::string *, Module *> data{&name, &module};
+  dl_iterate_phdr(CollectModule, &data);
+  return module;
+}
+
+const Database &GetDatabase() {
+  static Database db = [] {
+    Database db;
+    std::string path = lfx::config::Get("signature_db")
+                           .value_or(LATENCYFLEX_DATADIR "/latencyflex/signatures.db");
+    std::ifstream file(path);
+    if (!file) {
+      std::cerr << "LatencyFleX: Cannot open signature database " << path << std::endl;
+      return db;
+    }
+    std::string line;
+    size_t line_no = 0;
+    while (std::getline(file, line)) {
+      line_no++;
+      std::istringstream is(line);
+      std::string keyword;
+      if (!(is >> keyword) || keyword[0] == '#')
+        continue;
+      if (keyword == "version") {
+        is >> db.version;
+        continue;
+      }
+      // <function> <engine> <offset> <pattern...>
+      Signature sig;
+      sig.name = keyword;
+      std::string offset;
+      std::string pattern;
+      char *end = nullptr;
+      if (is >> sig.engine >> offset) {
+        errno = 0;
+        sig.offset = strtoll(offset.c_str(), &end, 0);
+      }
+      if (!end || *end != '\0' || errno == ERANGE || !std::getline(is, pattern) ||
+          !ParsePattern(pattern, &sig.pattern)) {
+        std::cerr << "LatencyFleX: " << path << ":" << line_no << ": malformed signature"
+                  << std::endl;
+        continue;
+      }
+      db.signatures.push_back(std::move(sig));
+    }
+    return db;
+  }();
+  return db;
+}
+
+std::string GetCachePath() {
+  std::string dir;
+  if (getenv("XDG_CACHE_HOME")) {
+    dir = getenv("XDG_CACHE_HOME");
+  } else if (getenv("HOME")) {
+    dir = std::string(getenv("HOME")) + "/.cache";
+  } else {
+    return "";
+  }
+  mkdir(dir.c_str(), 0755);
+  dir += "/latencyflex";
+  mkdir(dir.c_str(), 0755);
+  return dir + "/signatures.cache";
+}
+
+// The cache consists of lines of "<build-id> <database-version> <function> <offset>", where
+// offset is relative to the module base. Scans that come up empty are not cached, so that they
+// are retried once the database has an entry for the build.
+bool LookupCache(const std::string &build_id, uint32_t version, const std::string &name,
+                 uintptr_t base, uintptr_t *result) {
+  std::ifstream file(GetCachePath());
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream is(line);
+    std::string entry_id, entry_name, offset;
+    uint32_t entry_version;
+    if (!(is >> entry_id >> entry_version >> entry_name >> offset))
+      continue;
+    if (entry_id != build_id || entry_version != version || entry_name != name)
+      continue;
+    char *end;
+    errno = 0;
+    uintptr_t value = strtoull(offset.c_str(), &end, 16);
+    if (offset[0] == '-' || *end != '\0' || errno == ERANGE) {
+      // Truncated by a crash while writing, or edited by hand. Scan again instead.
+      std::cerr << "LatencyFleX: Ignoring malformed signature cache entry: " << line << std::endl;
+      continue;
+    }
+    *result = base + value;
+    return true;
+  }
+  return false;
+}
+
+void StoreCache(const std::string &build_id, uint32_t version, const std::string &name,
+                uintptr_t base, uintptr_t result) {
+  std::string path = GetCachePath();
+  if (path.empty())
+    return;
+  std::ofstream file(path, std::ios::app);
+  file << build_id << " " << version << " " << name << " " << std::hex << result - base << std::dec
+       << std::endl;
+}
+} // namespace
+
+bool ParsePattern(const std::string &text, Pattern *out) {
+  Pattern pattern;
+  std::istringstream is(text);
+  std::string token;
+  bool have_fixed = false;
+  while (is >> token) {
+    if (token == "?" || token == "??") {
+      pattern.bytes.push_back(0);
+      pattern.mask.push_back(0);
+      continue;
+    }
+    if (token.size() != 2 || !isxdigit(token[0]) || !isxdigit(token[1]))
+      return false;
+    if (!have_fixed)
+      pattern.first = pattern.bytes.size();
+    pattern.last = pattern.bytes.size();
+    have_fixed = true;
+    pattern.bytes.push_back((uint8_t)std::stoul(token, nullptr, 16));
+    pattern.mask.push_back(0xFF);
+  }
+  if (!have_fixed)
+    return false;
+  *out = std::move(pattern);
+  return true;
+}
+
+const uint8_t *FindPattern(const Pattern &pattern, const uint8_t *begin, const uint8_t *end) {
+#ifdef LATENCYFLEX_SIGSCAN_X86
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  if (has_avx2)
+    return FindAvx2(pattern, begin, end);
+  return FindSse2(pattern, begin, end);
+#else
+  return FindScalar(pattern, begin, end);
+#endif
+}
+
+uintptr_t ScanModule(const std::string &module, const Pattern &pattern) {
+  Module info = LoadModule(module);
+  for (const Segment &segment : info.segments) {
+    if (const uint8_t *match = FindPattern(pattern, segment.begin, segment.end))
+      return (uintptr_t)match;
+  }
+  return 0;
+}
+
+uintptr_t FindFunction(const std::string &module, const std::string &name) {
+  Module info = LoadModule(module);
+  if (!info.found) {
+    std::cerr << "LatencyFleX: Cannot find module " << module << " for signature scan"
+              << std::endl;
+    return 0;
+  }
+  const Database &db = GetDatabase();
+  uintptr_t result = 0;
+  if (!info.build_id.empty() && LookupCache(info.build_id, db.version, name, info.base, &result)) {
+    std::cerr << "LatencyFleX: Using cached signature scan result for " << name << std::endl;
+    return result;
+  }
+
+  uint64_t start = current_time_ns();
+  for (const Signature &sig : db.signatures) {
+    if (sig.name != name)
+      continue;
+    for (const Segment &segment : info.segments) {
+      if (const uint8_t *match = FindPattern(sig.pattern, segment.begin, segment.end)) {
+        result = (uintptr_t)match + sig.offset;
+        std::cerr << "LatencyFleX: Found " << name << " (" << sig.engine << ") at 0x" << std::hex
+                  << result - info.base << std::dec << std::endl;
+        break;
+      }
+    }
+    if (result)
+      break;
+  }
+  std::cerr << "LatencyFleX: Signature scan for " << name << " took "
+            << (current_time_ns() - start) / 1000000. << "ms" << std::endl;
+
+  if (!info.build_id.empty() && result)
+    StoreCache(info.build_id, db.version, name, info.base, result);
+  return result;
+}
+} // namespace sigscan
+} // namespace lfx
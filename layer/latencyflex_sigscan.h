@@ -0,0 +1,62 @@
+// Copyright 2022 Tatsuyuki Ishi
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef LATENCYFLEX_LATENCYFLEX_SIGSCAN_H
+#define LATENCYFLEX_LATENCYFLEX_SIGSCAN_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace lfx {
+namespace sigscan {
+// A byte pattern with wildcards, written in the common IDA-style notation: hexadecimal bytes
+// separated by spaces, with `?` or `??` standing for a byte that can take any value.
+// Example: "48 89 5C 24 ?? 55 57".
+struct Pattern {
+  std::vector<uint8_t> bytes;
+  // 0xFF for bytes that must match, 0x00 for wildcards.
+  std::vector<uint8_t> mask;
+  // Indices of the first and last non-wildcard byte. The vectorized search looks for these two
+  // bytes at the same time before verifying the rest of the pattern.
+  size_t first = 0;
+  size_t last = 0;
+};
+
+// Parse `text` into `out`. Returns false if the text is malformed or the pattern consists of
+// wildcards only.
+bool ParsePattern(const std::string &text, Pattern *out);
+
+// Find the first occurrence of `pattern` inside [begin, end). Returns nullptr if not found.
+//
+// The scan is vectorized with AVX2 when supported by the CPU, and SSE2 otherwise.
+const uint8_t *FindPattern(const Pattern &pattern, const uint8_t *begin, const uint8_t *end);
+
+// Scan the executable segments of a loaded module. `module` is matched against the file name of
+// each loaded object; an empty string selects the main executable.
+//
+// Returns the address of the first match, or 0 if not found.
+uintptr_t ScanModule(const std::string &module, const Pattern &pattern);
+
+// Look up a function by name in the signature database, e.g. "FEngineLoop::Tick", and scan
+// `module` for each known variant of it. Results are cached by the GNU build ID of the module,
+// so later launches of the same binary skip the scan.
+//
+// Returns the address of the function, or 0 if no variant matched.
+uintptr_t FindFunction(const std::string &module, const std::string &name);
+} // namespace sigscan
+} // namespace lfx
+
+#endif // LATENCYFLEX_LATENCYFLEX_SIGSCAN_H
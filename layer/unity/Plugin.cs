@@ -26,6 +26,34 @@ namespace LatencyFleX
         [DllImport("latencyflex_wine")]
         private static extern int winelfx_WaitAndBeginFrame();
 
+        [DllImport("latencyflex_layer")]
+        private static extern void lfx_MarkStage(uint stage);
+
+        [DllImport("latencyflex_wine")]
+        private static extern void winelfx_MarkStage(uint stage);
+
+#if LFX_USE_IL2CPP
+        // Used to look up the native entry point of lfx_WaitAndBeginFrame, see GetNativeWaitAndBeginFrame.
+        private const int RtldNow = 2;
+        private const int RtldNoload = 4;
+
+        [DllImport("libdl.so.2")]
+        private static extern IntPtr dlopen(string filename, int flags);
+
+        [DllImport("libdl.so.2")]
+        private static extern IntPtr dlsym(IntPtr handle, string symbol);
+
+        [DllImport("kernel32", EntryPoint = "GetModuleHandleA")]
+        private static extern IntPtr GetModuleHandle(string moduleName);
+
+        [DllImport("kernel32")]
+        private static extern IntPtr GetProcAddress(IntPtr module, string procName);
+#endif
+
+        // Keep in sync with latencyflex_layer.h.
+        private const uint StageSimulationEnd = 1;
+        private const uint StageRenderSubmit = 2;
+
         private bool _isWine = false;
 
         private ManualLogSource _log;
@@ -71,14 +99,34 @@ namespace LatencyFleX
                 }
             });
 
+            // Stage markers are opt-in: they add two more native calls per frame.
+            var withStageMarkers = Environment.GetEnvironmentVariable("LFX_UNITY_STAGE_MARKERS") == "1";
+            var simulationEndDelegate = MakeStageDelegate(StageSimulationEnd);
+            var renderSubmitDelegate = MakeStageDelegate(StageRenderSubmit);
+
 #if LFX_USE_IL2CPP
+            // Call into the runtime directly from the player loop, which avoids a transition into the managed
+            // runtime (and potential GC pauses) right at the wake-up time. updateFunction points to a variable
+            // holding the function pointer; it is never freed as the player loop keeps referencing it.
+            var updateFunction = System.IntPtr.Zero;
+            var nativeWaitAndBeginFrame = GetNativeWaitAndBeginFrame();
+            if (nativeWaitAndBeginFrame != System.IntPtr.Zero)
+            {
+                updateFunction = Marshal.AllocHGlobal(System.IntPtr.Size);
+                Marshal.WriteIntPtr(updateFunction, nativeWaitAndBeginFrame);
+            }
+            else
+            {
+                _log.LogWarning("Cannot find the native entry point: falling back to a managed delegate");
+            }
+
             ClassInjector.RegisterTypeInIl2Cpp<LfxBeforeLoopInit>();
             var mySystem = new PlayerLoopSystemInternal
             {
                 type = UnhollowerRuntimeLib.Il2CppType.Of<LfxBeforeLoopInit>(),
-                updateDelegate = updateDelegate,
+                updateDelegate = updateFunction == System.IntPtr.Zero ? updateDelegate : null,
                 numSubSystems = 0,
-                updateFunction = System.IntPtr.Zero,
+                updateFunction = updateFunction,
                 loopConditionFunction = System.IntPtr.Zero,
             };
             
@@ -88,6 +136,27 @@ namespace LatencyFleX
             // System 0 is the root node. It will never be executed
             systems[0].numSubSystems++;
             systems.Insert(1, mySystem);
+            if (withStageMarkers)
+            {
+                ClassInjector.RegisterTypeInIl2Cpp<LfxAfterLateUpdate>();
+                ClassInjector.RegisterTypeInIl2Cpp<LfxAfterRendering>();
+                InsertInternal(systems, "PreLateUpdate", null, new PlayerLoopSystemInternal
+                {
+                    type = UnhollowerRuntimeLib.Il2CppType.Of<LfxAfterLateUpdate>(),
+                    updateDelegate = simulationEndDelegate,
+                    numSubSystems = 0,
+                    updateFunction = System.IntPtr.Zero,
+                    loopConditionFunction = System.IntPtr.Zero,
+                });
+                InsertInternal(systems, "PostLateUpdate", "FinishFrameRendering", new PlayerLoopSystemInternal
+                {
+                    type = UnhollowerRuntimeLib.Il2CppType.Of<LfxAfterRendering>(),
+                    updateDelegate = renderSubmitDelegate,
+                    numSubSystems = 0,
+                    updateFunction = System.IntPtr.Zero,
+                    loopConditionFunction = System.IntPtr.Zero,
+                });
+            }
             PlayerLoop.SetPlayerLoopInternal(systems.ToArray());
 #else
             var mySystem = new PlayerLoopSystem
@@ -108,15 +177,136 @@ namespace LatencyFleX
             initSubSystem.subSystemList = subSystem.ToArray();
             playerLoop.subSystemList[0] = initSubSystem;
 
+            if (withStageMarkers)
+            {
+                Insert(ref playerLoop, "PreLateUpdate", null, new PlayerLoopSystem
+                {
+                    type = typeof(LfxAfterLateUpdate),
+                    updateDelegate = new PlayerLoopSystem.UpdateFunction(simulationEndDelegate),
+                });
+                Insert(ref playerLoop, "PostLateUpdate", "FinishFrameRendering", new PlayerLoopSystem
+                {
+                    type = typeof(LfxAfterRendering),
+                    updateDelegate = new PlayerLoopSystem.UpdateFunction(renderSubmitDelegate),
+                });
+            }
+
             PlayerLoop.SetPlayerLoop(playerLoop);
 #endif
 
             _log.LogInfo("Plugin " + PluginInfo.PLUGIN_GUID + " is loaded!");
         }
+
+        private Action MakeStageDelegate(uint stage)
+        {
+            return () =>
+            {
+                if (_isWine)
+                {
+                    winelfx_MarkStage(stage);
+                }
+                else
+                {
+                    lfx_MarkStage(stage);
+                }
+            };
+        }
+
+#if LFX_USE_IL2CPP
+        // Look up lfx_WaitAndBeginFrame (or its Wine bridge counterpart) in the already loaded runtime library.
+        // Returns IntPtr.Zero if not found.
+        private IntPtr GetNativeWaitAndBeginFrame()
+        {
+            try
+            {
+                if (_isWine)
+                {
+                    var module = GetModuleHandle("latencyflex_wine.dll");
+                    return module == IntPtr.Zero ? IntPtr.Zero : GetProcAddress(module, "winelfx_WaitAndBeginFrame");
+                }
+
+                var handle = dlopen("liblatencyflex_layer.so", RtldNow | RtldNoload);
+                return handle == IntPtr.Zero ? IntPtr.Zero : dlsym(handle, "lfx_WaitAndBeginFrame");
+            }
+            catch (Exception e) when (e is DllNotFoundException || e is EntryPointNotFoundException)
+            {
+                return IntPtr.Zero;
+            }
+        }
+
+        // The internal player loop is a flattened tree, where numSubSystems counts all descendants of a node.
+        // Insert `system` into the top-level system named `parent`, right after the child named `after`, or at the
+        // end if `after` is null or not found.
+        private void InsertInternal(List<PlayerLoopSystemInternal> systems, string parent, string after,
+            PlayerLoopSystemInternal system)
+        {
+            var parentIndex = -1;
+            for (var i = 1; i < systems.Count; i += systems[i].numSubSystems + 1)
+            {
+                if (systems[i].type.Name == parent)
+                {
+                    parentIndex = i;
+                    break;
+                }
+            }
+
+            if (parentIndex < 0)
+            {
+                _log.LogWarning("Cannot find " + parent + " in the player loop, stage marker disabled");
+                return;
+            }
+
+            var end = parentIndex + systems[parentIndex].numSubSystems + 1;
+            var index = end;
+            if (after != null)
+            {
+                for (var i = parentIndex + 1; i < end; i += systems[i].numSubSystems + 1)
+                {
+                    if (systems[i].type.Name == after)
+                    {
+                        index = i + systems[i].numSubSystems + 1;
+                        break;
+                    }
+                }
+            }
+
+            systems[0].numSubSystems++;
+            systems[parentIndex].numSubSystems++;
+            systems.Insert(index, system);
+        }
+#else
+        // Insert `system` into the top-level system named `parent`, right after the child named `after`, or at the
+        // end if `after` is null or not found.
+        private void Insert(ref PlayerLoopSystem playerLoop, string parent, string after, PlayerLoopSystem system)
+        {
+            for (var i = 0; i < playerLoop.subSystemList.Length; i++)
+            {
+                var parentSystem = playerLoop.subSystemList[i];
+                if (parentSystem.type.Name != parent)
+                {
+                    continue;
+                }
+
+                var subSystem = new List<PlayerLoopSystem>(parentSystem.subSystemList);
+                var index = after == null ? -1 : subSystem.FindIndex(s => s.type.Name == after);
+                subSystem.Insert(index < 0 ? subSystem.Count : index + 1, system);
+                parentSystem.subSystemList = subSystem.ToArray();
+                playerLoop.subSystemList[i] = parentSystem;
+                return;
+            }
+
+            _log.LogWarning("Cannot find " + parent + " in the player loop, stage marker disabled");
+        }
+#endif
+
 #if LFX_USE_IL2CPP        
         private class LfxBeforeLoopInit: Il2CppSystem.Object {}
+        private class LfxAfterLateUpdate: Il2CppSystem.Object {}
+        private class LfxAfterRendering: Il2CppSystem.Object {}
 #else
         private class LfxBeforeLoopInit {}
+        private class LfxAfterLateUpdate {}
+        private class LfxAfterRendering {}
 #endif
     }
     
@@ -31,6 +31,30 @@
 enum lfx_funcs {
   unix_WaitAndBeginFrame,
   unix_SetTargetFrameTime,
+  unix_MarkStage,
+  unix_BeginPresent,
+  unix_EndFrame,
+  unix_EndFrameOnFence,
+  unix_EndFrameOnSemaphore,
+  unix_GetSubmitDeadline,
+};
+
+// Keep these in sync with unixlib.cpp.
+struct EndFrameParams {
+  UINT64 frame_id;
+  UINT64 timestamp;
+  UINT64 age;
+};
+
+struct EndFrameOnParams {
+  UINT64 handle;
+  UINT64 value;
+  UINT64 frame_id;
+};
+
+struct SubmitDeadlineParams {
+  UINT64 deadline;
+  UINT64 now;
 };
 
 // Internal definitions copied out of the wine source tree.
@@ -61,6 +85,59 @@ extern "C" VK_LAYER_EXPORT void winelfx_SetTargetFrameTime(__int64 target_frame_
   UNIX_CALL(SetTargetFrameTime, &target_frame_time);
 }
 
+extern "C" VK_LAYER_EXPORT void winelfx_MarkStage(UINT32 stage) { UNIX_CALL(MarkStage, &stage); }
+
+extern "C" VK_LAYER_EXPORT UINT64 winelfx_BeginPresent() {
+  UINT64 frame_id = 0;
+  UNIX_CALL(BeginPresent, &frame_id);
+  return frame_id;
+}
+
+// `timestamp` is in QueryPerformanceCounter ticks, or 0 for the current time. The clock of the
+// layer is not available on the Windows side, so the time elapsed since `timestamp` is passed
+// instead.
+extern "C" VK_LAYER_EXPORT void winelfx_EndFrame(UINT64 frame_id, UINT64 timestamp) {
+  EndFrameParams params = {frame_id, timestamp, 0};
+  if (timestamp != 0) {
+    LARGE_INTEGER qpc_now, qpc_frequency;
+    QueryPerformanceCounter(&qpc_now);
+    QueryPerformanceFrequency(&qpc_frequency);
+    double ticks_ago = (double)(qpc_now.QuadPart - (INT64)timestamp);
+    params.age = ticks_ago > 0 ? (UINT64)(ticks_ago * 1e9 / qpc_frequency.QuadPart) : 0;
+  }
+  UNIX_CALL(EndFrame, &params);
+}
+
+// `device` is ignored by both calls below, as the layer does not see the application's handle. The
+// frame ends on the only device of the process, so applications with several devices are not
+// supported.
+extern "C" VK_LAYER_EXPORT UINT64 winelfx_EndFrameOnFence(void *device, UINT64 fence) {
+  EndFrameOnParams params = {fence, 0, 0};
+  UNIX_CALL(EndFrameOnFence, &params);
+  return params.frame_id;
+}
+
+extern "C" VK_LAYER_EXPORT UINT64 winelfx_EndFrameOnSemaphore(void *device, UINT64 semaphore,
+                                                              UINT64 value) {
+  EndFrameOnParams params = {semaphore, value, 0};
+  UNIX_CALL(EndFrameOnSemaphore, &params);
+  return params.frame_id;
+}
+
+// The deadline is converted to QueryPerformanceCounter ticks, or 0 if not known yet.
+extern "C" VK_LAYER_EXPORT UINT64 winelfx_GetSubmitDeadline() {
+  LARGE_INTEGER qpc_now, qpc_frequency;
+  QueryPerformanceCounter(&qpc_now);
+  QueryPerformanceFrequency(&qpc_frequency);
+  SubmitDeadlineParams params = {0, 0};
+  UNIX_CALL(GetSubmitDeadline, &params);
+  if (params.deadline == 0)
+    return 0;
+  double time_left = (double)(INT64)(params.deadline - params.now);
+  INT64 deadline = qpc_now.QuadPart + (INT64)(time_left * qpc_frequency.QuadPart / 1e9);
+  return deadline > 0 ? deadline : 1;
+}
+
 BOOL WINAPI DllMain(HINSTANCE hinst, DWORD reason, LPVOID reserved) {
   switch (reason) {
   case DLL_PROCESS_ATTACH:
@@ -1,2 +1,8 @@
 @ cdecl lfx_WaitAndBeginFrame() winelfx_WaitAndBeginFrame
-@ cdecl lfx_SetTargetFrameTime(int64) winelfx_SetTargetFrameTime
\ No newline at end of file
+@ cdecl lfx_SetTargetFrameTime(int64) winelfx_SetTargetFrameTime
+@ cdecl lfx_MarkStage(long) winelfx_MarkStage
+@ cdecl lfx_BeginPresent() winelfx_BeginPresent
+@ cdecl lfx_EndFrame(int64 int64) winelfx_EndFrame
+@ cdecl lfx_EndFrameOnFence(ptr int64) winelfx_EndFrameOnFence
+@ cdecl lfx_EndFrameOnSemaphore(ptr int64 int64) winelfx_EndFrameOnSemaphore
+@ cdecl lfx_GetSubmitDeadline() winelfx_GetSubmitDeadline
\ No newline at end of file
@@ -1,2 +1,8 @@
 @ cdecl winelfx_WaitAndBeginFrame() latencyflex_layer.lfx_WaitAndBeginFrame
-@ cdecl winelfx_SetTargetFrameTime(int64) latencyflex_layer.lfx_SetTargetFrameTime
\ No newline at end of file
+@ cdecl winelfx_SetTargetFrameTime(int64) latencyflex_layer.lfx_SetTargetFrameTime
+@ cdecl winelfx_MarkStage(long) latencyflex_layer.lfx_MarkStage
+@ cdecl winelfx_BeginPresent() latencyflex_layer.lfx_BeginPresent
+@ cdecl winelfx_EndFrame(int64 int64) latencyflex_layer.lfx_EndFrame
+@ cdecl winelfx_EndFrameOnFence(ptr int64) latencyflex_layer.lfx_EndFrameOnFence
+@ cdecl winelfx_EndFrameOnSemaphore(ptr int64 int64) latencyflex_layer.lfx_EndFrameOnSemaphore
+@ cdecl winelfx_GetSubmitDeadline() latencyflex_layer.lfx_GetSubmitDeadline
\ No newline at end of file
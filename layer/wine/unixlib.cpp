@@ -32,12 +32,77 @@ static NTSTATUS winelfx_SetTargetFrameTime(void *target_frame_time) {
   return 0;
 }
 
+static NTSTATUS winelfx_MarkStage(void *stage) {
+  lfx_MarkStage(*(uint32_t *)stage);
+  return 0;
+}
+
+// Parameter structs of the calls with several arguments or a result. Keep these in sync with
+// builtin.cpp.
+struct EndFrameParams {
+  uint64_t frame_id;
+  uint64_t timestamp;
+  uint64_t age;
+};
+
+struct EndFrameOnParams {
+  uint64_t handle;
+  uint64_t value;
+  uint64_t frame_id;
+};
+
+static NTSTATUS winelfx_BeginPresent(void *frame_id) {
+  *(uint64_t *)frame_id = lfx_BeginPresent();
+  return 0;
+}
+
+static NTSTATUS winelfx_EndFrame(void *args) {
+  EndFrameParams *params = (EndFrameParams *)args;
+  // `timestamp` is a QueryPerformanceCounter value: only `age`, the time since, is meaningful here.
+  lfx_EndFrame(params->frame_id, params->timestamp != 0 ? current_time_ns() - params->age : 0);
+  return 0;
+}
+
+// The application's VkDevice is a winevulkan wrapper, so the frame always ends on the only device.
+// Applications with several devices are not supported.
+static NTSTATUS winelfx_EndFrameOnFence(void *args) {
+  EndFrameOnParams *params = (EndFrameOnParams *)args;
+  params->frame_id = lfx_EndFrameOnFence(nullptr, params->handle);
+  return 0;
+}
+
+static NTSTATUS winelfx_EndFrameOnSemaphore(void *args) {
+  EndFrameOnParams *params = (EndFrameOnParams *)args;
+  params->frame_id = lfx_EndFrameOnSemaphore(nullptr, params->handle, params->value);
+  return 0;
+}
+
+struct SubmitDeadlineParams {
+  uint64_t deadline;
+  uint64_t now;
+};
+
+// The clock of the deadline is not available on the Windows side, so the current time is returned
+// along with it for conversion.
+static NTSTATUS winelfx_GetSubmitDeadline(void *args) {
+  SubmitDeadlineParams *params = (SubmitDeadlineParams *)args;
+  params->deadline = lfx_GetSubmitDeadline();
+  params->now = current_time_ns();
+  return 0;
+}
+
 // extern declaration is required, or g++ would happily mangle the symbol name
 extern const unixlib_entry_t __wine_unix_call_funcs[];
 // Keep this in sync with builtin.cpp.
 const unixlib_entry_t __wine_unix_call_funcs[] = {
     winelfx_WaitAndBeginFrame,
     winelfx_SetTargetFrameTime,
+    winelfx_MarkStage,
+    winelfx_BeginPresent,
+    winelfx_EndFrame,
+    winelfx_EndFrameOnFence,
+    winelfx_EndFrameOnSemaphore,
+    winelfx_GetSubmitDeadline,
 };
 
 } // extern "C"
\ No newline at end of file